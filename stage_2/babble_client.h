@@ -16,5 +16,10 @@ int client_publish(int sock, char* msg, int with_streaming);
 int client_timeline(int sock, int silent);
 int client_rdv(int sock);
 
+/* returns the statistics report of the server (to be freed), or
+ * NULL; if section is not NULL, asks for that section (RESET
+ * restarts the statistics) */
+char *client_stats(int sock, const char *section);
+
 
 #endif
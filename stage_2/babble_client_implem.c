@@ -361,3 +361,30 @@ int client_rdv(int sock)
     free(ack);
     return -1;
 }
+
+char *client_stats(int sock, const char *section)
+{
+    char buffer[BABBLE_BUFFER_SIZE];
+    memset(buffer, 0, BABBLE_BUFFER_SIZE);
+
+    if(section != NULL){
+        snprintf(buffer, BABBLE_BUFFER_SIZE, "%d %s\n", STATS, section);
+    }
+    else{
+        snprintf(buffer, BABBLE_BUFFER_SIZE, "%d\n", STATS);
+    }
+
+    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+        fprintf(stderr,"Error -- sending STATS message\n");
+        return NULL;
+    }
+
+    char* ack=recv_one_msg(sock);
+
+    if(ack == NULL){
+        fprintf(stderr,"ERROR in STATS ack\n");
+        return NULL;
+    }
+
+    return ack;
+}
@@ -35,20 +35,21 @@ static int write_data(int fd, unsigned long size, void* buf)
 static int read_data(int fd, unsigned long size, void* buf)
 {
     unsigned long total_recv=0;
-    unsigned long recv=0;
+    ssize_t recv=0;
 
     do {
         recv = read(fd, ((char*) buf+total_recv), size - total_recv);
         if (recv > 0){
             total_recv += recv;
         }
-    } while(total_recv < size  || (recv == -1 && errno == EINTR));
+        /* stop on end of file (client disconnected) and errors */
+    } while(total_recv < size && (recv > 0 || (recv == -1 && errno == EINTR)));
 
     if(recv == -1){
         perror("read_data");
     }
-    else{    
-        if(total_recv < size){
+    else{
+        if(total_recv < size && total_recv > 0){
             fprintf(stderr,"received only %lu/%lu bytes\n", total_recv, size);
         }
     }
@@ -59,6 +60,16 @@ static int read_data(int fd, unsigned long size, void* buf)
 
 
 
+int network_send_raw(int fd, unsigned long size, void* buf)
+{
+    if(write_data(fd, size, buf) != size){
+        perror("writing on socket");
+        return -1;
+    }
+
+    return size;
+}
+
 int network_send(int fd, unsigned long size, void* buf)
 {   
     if(write_data(fd, sizeof(unsigned long), &size) != sizeof(unsigned long)){
@@ -15,6 +15,10 @@
 /* send the buffer buf of size "size" using the file descriptor fd */
 int network_send(int fd, unsigned long size, void* buf);
 
+/* send the buffer buf as is, without header (buf is expected to be
+ * already formatted according to the protocol) */
+int network_send_raw(int fd, unsigned long size, void* buf);
+
 /* recv data from the file descriptor fd */
 /* a buffer is allocated to store the data, its size is returned */
 int network_recv(int fd, void **buf);
@@ -13,13 +13,104 @@
 
 #define BABBLE_PORT 5656
 #define MAX_CLIENT 1000
-#define MAX_FOLLOW MAX_CLIENT
+
+/* size of a cache line, hot data written by different threads is kept
+ * on separate lines */
+#define BABBLE_CACHELINE_SIZE 64
+#define BABBLE_CACHELINE_ALIGNED __attribute__((aligned(BABBLE_CACHELINE_SIZE)))
+
+/* nb of followers stored inline in a client bundle before switching
+ * to a hash table */
+#define BABBLE_FOLLOWERS_INLINE 8
 
 
 #define BABBLE_TIMELINE_MAX 4
 
+/* hybrid fan-out: clients with more followers than the threshold are
+ * not pushed into the timelines of their followers. The initial
+ * threshold is adapted every BABBLE_HYBRID_PERIOD ms according to
+ * the ratio between TIMELINE and PUBLISH rates, and kept within
+ * [BABBLE_HYBRID_THRESHOLD_MIN, BABBLE_HYBRID_THRESHOLD_MAX] */
+#define BABBLE_HYBRID_THRESHOLD 100
+#define BABBLE_HYBRID_THRESHOLD_MIN 16
+#define BABBLE_HYBRID_THRESHOLD_MAX 10000
+#define BABBLE_HYBRID_PERIOD 1000
+
 #define BABBLE_EXECUTOR_THREADS 10
 
+/* publications to more than BABBLE_FANOUT_CHUNK followers are fanned
+ * out in chunks of that size by BABBLE_FANOUT_THREADS workers */
+#define BABBLE_FANOUT_CHUNK 128
+#define BABBLE_FANOUT_THREADS 4
+#define BABBLE_FANOUT_QUEUE_SIZE 64
+
+/* answers are built in place in a buffer of this size, larger answers
+ * move to the heap */
+#define BABBLE_ANSWER_ARENA_SIZE 1024
+
+/* slab allocator (built with -DBABBLE_USE_SLAB, see Makefile): each
+ * thread keeps magazines of BABBLE_SLAB_MAGAZINE_SIZE free objects,
+ * refilled from slabs of BABBLE_SLAB_SIZE bytes; set
+ * BABBLE_SLAB_HUGEPAGES to back the slabs with huge pages */
+#define BABBLE_SLAB_SIZE (2 * 1024 * 1024)
+#define BABBLE_SLAB_MAGAZINE_SIZE 32
+#define BABBLE_SLAB_MAX_CACHES 8
+#define BABBLE_SLAB_HUGEPAGES 0
+
+/* logging: each thread has a ring of BABBLE_LOG_RING_SIZE messages,
+ * drained every BABBLE_LOG_FLUSH_PERIOD ms; a call site logs at most
+ * BABBLE_LOG_RATE messages per second. Levels (0 error, 1 warning,
+ * 2 info, 3 debug) above BABBLE_LOG_MAX_LEVEL are compiled out */
+#define BABBLE_LOG_RING_SIZE 256
+#define BABBLE_LOG_MSG_SIZE 128
+#define BABBLE_LOG_FLUSH_PERIOD 10
+#define BABBLE_LOG_RATE 20
+#define BABBLE_LOG_LEVEL 2
+#define BABBLE_LOG_MAX_LEVEL 3
+
+/* latency histograms: values are recorded within a relative error of
+ * 2^-BABBLE_HISTOGRAM_SUB_BITS, up to 2^BABBLE_HISTOGRAM_MAX_BITS ns */
+#define BABBLE_HISTOGRAM_SUB_BITS 5
+#define BABBLE_HISTOGRAM_MAX_BITS 40
+
+/* the statistics of the threads are spread over BABBLE_STATS_SHARDS
+ * shards; the reply to STATS is at most BABBLE_STATS_REPLY_SIZE bytes */
+#define BABBLE_STATS_SHARDS 16
+#define BABBLE_STATS_REPLY_SIZE 4096
+
+/* size of the buffer of the metrics endpoint (see babble_metrics.h);
+ * out of file descriptors, it retries accepting every
+ * BABBLE_METRICS_RETRY_DELAY ms */
+#define BABBLE_METRICS_BUFFER_SIZE 65536
+#define BABBLE_METRICS_RETRY_DELAY 100
+
+/* nb of instances reported for each lock class when the locks are
+ * profiled (LOCK_PROFILING=1, see Makefile) */
+#define BABBLE_LOCK_TOP 3
+
+/* tracing: each thread keeps its last BABBLE_TRACE_RING_SIZE events
+ * (see babble_trace.h) */
+#define BABBLE_TRACE_RING_SIZE 4096
+
+/* profiler: each of at most BABBLE_PROFILER_THREADS live threads
+ * keeps BABBLE_PROFILER_SAMPLES samples of BABBLE_PROFILER_DEPTH
+ * frames between two dumps */
+#define BABBLE_PROFILER_THREADS 64
+#define BABBLE_PROFILER_SAMPLES 1024
+#define BABBLE_PROFILER_DEPTH 32
+
+/* memory accounting: the peak of the live bytes is sampled every
+ * BABBLE_MEMORY_PEAK_PERIOD allocations of each thread */
+#define BABBLE_MEMORY_PEAK_PERIOD 64
+
+/* heaviest clients: the sketch of each thread tracks
+ * BABBLE_TOPK_CAPACITY clients (at most 256), found through
+ * BABBLE_TOPK_HINTS hints (a power of two, at most 256); STATS TOP
+ * reports BABBLE_TOPK_REPORT of them */
+#define BABBLE_TOPK_CAPACITY 64
+#define BABBLE_TOPK_HINTS 256
+#define BABBLE_TOPK_REPORT 10
+
 /* defines the size of the prod-cons buffer */
 #define BABBLE_PRODCONS_SIZE 4
 
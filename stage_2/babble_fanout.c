@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "babble_fanout.h"
+#include "babble_trace.h"
+
+/* one publication being fanned out */
+typedef struct fanout_job{
+    publication_t *pub; /* the job holds a reference */
+    client_bundle_t **followers;
+    unsigned int nb_followers;
+    unsigned int nb_chunks;
+    unsigned int next_chunk; /* next chunk to be claimed */
+    unsigned int nb_chunks_done;
+    int refcount; /* publishing thread + queued tickets */
+
+    int wait; /* set if the publishing thread waits for the end */
+    int finished;
+    babble_mutex_t lock;
+    pthread_cond_t finished_cond;
+
+    fanout_done_fn done;
+    void *done_arg;
+} fanout_job_t;
+
+/* queue of tickets: each ticket asks a worker to help with a job */
+static fanout_job_t *fanout_queue[BABBLE_FANOUT_QUEUE_SIZE];
+static int queue_start = 0;
+static int queue_end = 0;
+
+static babble_mutex_t queue_mutex = BABBLE_MUTEX_INITIALIZER(LOCK_FANOUT_QUEUE);
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+
+static pthread_t fanout_threads[BABBLE_FANOUT_THREADS];
+
+static void release_job(fanout_job_t *job)
+{
+    if (__sync_sub_and_fetch(&job->refcount, 1) != 0)
+    {
+        return;
+    }
+
+    free(job->followers);
+    publication_put(job->pub);
+    babble_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->finished_cond);
+    free(job);
+}
+
+static void finish_job(fanout_job_t *job)
+{
+    if (job->wait)
+    {
+        babble_mutex_lock(&job->lock);
+        job->finished = 1;
+        pthread_cond_signal(&job->finished_cond);
+        babble_mutex_unlock(&job->lock);
+    }
+    else if (job->done != NULL)
+    {
+        job->done(job->done_arg);
+    }
+}
+
+/* claims and processes chunks of job until none is left */
+static void run_chunks(fanout_job_t *job)
+{
+    unsigned int chunk = 0;
+    unsigned int i = 0;
+    unsigned int last = 0;
+    uint64_t start = 0;
+
+    while ((chunk = __sync_fetch_and_add(&job->next_chunk, 1)) < job->nb_chunks)
+    {
+        i = chunk * BABBLE_FANOUT_CHUNK;
+        last = i + BABBLE_FANOUT_CHUNK;
+        if (last > job->nb_followers)
+        {
+            last = job->nb_followers;
+        }
+
+        start = trace_begin();
+        for (; i < last; i++)
+        {
+            timeline_insert(job->followers[i]->timeline, job->pub);
+        }
+        trace_span(TRACE_FANOUT_CHUNK, start, job->pub->seq, last - chunk * BABBLE_FANOUT_CHUNK);
+
+        if (__sync_add_and_fetch(&job->nb_chunks_done, 1) == job->nb_chunks)
+        {
+            finish_job(job);
+        }
+    }
+}
+
+/* returns 0 if a ticket for job could be queued */
+static int enqueue_ticket(fanout_job_t *job)
+{
+    babble_mutex_lock(&queue_mutex);
+
+    if ((queue_end + 1) % BABBLE_FANOUT_QUEUE_SIZE == queue_start)
+    {
+        babble_mutex_unlock(&queue_mutex);
+        return -1;
+    }
+
+    fanout_queue[queue_end] = job;
+    queue_end = (queue_end + 1) % BABBLE_FANOUT_QUEUE_SIZE;
+
+    pthread_cond_signal(&queue_not_empty);
+    babble_mutex_unlock(&queue_mutex);
+
+    return 0;
+}
+
+static void *fanout_thread(void *arg)
+{
+    fanout_job_t *job = NULL;
+
+    while (1)
+    {
+        babble_mutex_lock(&queue_mutex);
+        while (queue_start == queue_end)
+        {
+            babble_cond_wait(&queue_not_empty, &queue_mutex);
+        }
+        job = fanout_queue[queue_start];
+        queue_start = (queue_start + 1) % BABBLE_FANOUT_QUEUE_SIZE;
+        babble_mutex_unlock(&queue_mutex);
+
+        run_chunks(job);
+        release_job(job);
+    }
+
+    return NULL;
+}
+
+void fanout_init(void)
+{
+    int i = 0;
+
+    for (i = 0; i < BABBLE_FANOUT_THREADS; i++)
+    {
+        pthread_create(&fanout_threads[i], NULL, fanout_thread, NULL);
+        pthread_detach(fanout_threads[i]);
+    }
+}
+
+void fanout_publish(publication_t *pub, client_bundle_t **followers, unsigned int nb_followers, int wait, fanout_done_fn done, void *done_arg)
+{
+    fanout_job_t *job = malloc(sizeof(fanout_job_t));
+    unsigned int i = 0;
+
+    publication_get(pub);
+    job->pub = pub;
+    job->followers = followers;
+    job->nb_followers = nb_followers;
+    job->nb_chunks = (nb_followers + BABBLE_FANOUT_CHUNK - 1) / BABBLE_FANOUT_CHUNK;
+    job->next_chunk = 0;
+    job->nb_chunks_done = 0;
+    job->refcount = 1;
+    job->wait = wait;
+    job->finished = 0;
+    babble_mutex_init(&job->lock, LOCK_FANOUT_JOB);
+    pthread_cond_init(&job->finished_cond, NULL);
+    job->done = done;
+    job->done_arg = done_arg;
+
+    if (nb_followers == 0)
+    {
+        release_job(job);
+        if (done != NULL && !wait)
+        {
+            done(done_arg);
+        }
+        return;
+    }
+
+    /* one ticket per chunk, except the one taken by this thread; if
+     * the queue is full, this thread will process more chunks */
+    for (i = 1; i < job->nb_chunks; i++)
+    {
+        __sync_fetch_and_add(&job->refcount, 1);
+        if (enqueue_ticket(job))
+        {
+            __sync_fetch_and_sub(&job->refcount, 1);
+            break;
+        }
+    }
+
+    run_chunks(job);
+
+    if (wait)
+    {
+        babble_mutex_lock(&job->lock);
+        while (!job->finished)
+        {
+            babble_cond_wait(&job->finished_cond, &job->lock);
+        }
+        babble_mutex_unlock(&job->lock);
+    }
+
+    release_job(job);
+}
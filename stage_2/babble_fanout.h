@@ -0,0 +1,29 @@
+#ifndef __BABBLE_FANOUT_H__
+#define __BABBLE_FANOUT_H__
+
+#include "babble_types.h"
+#include "babble_timeline.h"
+
+/**** Parallel fan-out of publications ****/
+
+/* the timelines to update are split into chunks of
+ * BABBLE_FANOUT_CHUNK followers. Chunks are processed by a pool of
+ * BABBLE_FANOUT_THREADS fan-out workers, the publishing thread
+ * taking its share of the chunks. */
+
+/* called once the whole fan-out of a publication is done */
+typedef void (*fanout_done_fn)(void *arg);
+
+/* starts the fan-out workers */
+void fanout_init(void);
+
+/* inserts pub in the timelines of the nb_followers clients stored in
+ * followers; the followers array has to be allocated with malloc(),
+ * it is freed by the fan-out */
+/* if wait is set, returns once all timelines have been updated;
+ * otherwise returns as soon as the publishing thread is done with
+ * its chunks, and done(done_arg) is called by the thread finishing
+ * the last chunk */
+void fanout_publish(publication_t *pub, client_bundle_t **followers, unsigned int nb_followers, int wait, fanout_done_fn done, void *done_arg);
+
+#endif
@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "babble_followers.h"
+#include "babble_memory.h"
+
+/* marks a slot whose client has been removed */
+#define FOLLOWER_TOMBSTONE ((struct client_bundle *)2)
+
+/* tag of the slots that are being moved to a new table */
+#define FOLLOWER_FROZEN ((uintptr_t)1)
+
+/* initial number of slots when the set leaves the inline array */
+#define FOLLOWER_TABLE_MIN 32
+
+static unsigned int follower_hash(struct client_bundle *client, unsigned int table_size)
+{
+    uint64_t h = (uint64_t)(uintptr_t)client;
+
+    /* bundles are at least 8-byte aligned, mix the upper bits down */
+    h = (h >> 3) * 0x9E3779B97F4A7C15ULL;
+
+    return (unsigned int)(h >> 32) & (table_size - 1);
+}
+
+static struct client_bundle *load_client(follower_entry_t *e)
+{
+    return __atomic_load_n(&e->client, __ATOMIC_ACQUIRE);
+}
+
+static int is_frozen(struct client_bundle *c)
+{
+    return ((uintptr_t)c & FOLLOWER_FROZEN) != 0;
+}
+
+static struct client_bundle *unfrozen(struct client_bundle *c)
+{
+    return (struct client_bundle *)((uintptr_t)c & ~FOLLOWER_FROZEN);
+}
+
+static int is_live(struct client_bundle *c)
+{
+    c = unfrozen(c);
+    return c != NULL && c != FOLLOWER_TOMBSTONE;
+}
+
+/* the slots of the current storage of set */
+/* the load is ordered after the increment of readers by
+ * enter_set(), see free_retired() */
+static follower_entry_t *current_items(follower_set_t *set, unsigned int *nb_items)
+{
+    follower_table_t *table = __atomic_load_n(&set->table, __ATOMIC_SEQ_CST);
+
+    if (table == NULL)
+    {
+        *nb_items = BABBLE_FOLLOWERS_INLINE;
+        return set->inline_items;
+    }
+
+    *nb_items = table->size;
+    return table->slots;
+}
+
+static void free_table(follower_table_t *table)
+{
+    mem_account_free(MEM_FOLLOWERS, sizeof(follower_table_t) + table->size * sizeof(follower_entry_t));
+    free(table);
+}
+
+/* frees the retired tables of set if no reader is left; the tables
+ * were unpublished before being retired, so a reader counted after
+ * the check can only see the current table. Called with resize_lock
+ * held */
+static void free_retired(follower_set_t *set)
+{
+    follower_table_t *table = NULL;
+    follower_table_t *next = NULL;
+
+    if (__atomic_load_n(&set->readers, __ATOMIC_SEQ_CST) != 0)
+    {
+        return;
+    }
+
+    table = set->retired;
+    __atomic_store_n(&set->retired, NULL, __ATOMIC_RELAXED);
+    while (table != NULL)
+    {
+        next = table->retired;
+        free_table(table);
+        table = next;
+    }
+}
+
+/* has to be called before accessing the slots of set */
+static void enter_set(follower_set_t *set)
+{
+    __atomic_fetch_add(&set->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* the last reader to leave frees the retired tables; either it sees
+ * the table retired by a concurrent rehash, or the rehash saw it
+ * leave */
+static void leave_set(follower_set_t *set)
+{
+    if (__atomic_sub_fetch(&set->readers, 1, __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&set->retired, __ATOMIC_SEQ_CST) != NULL)
+    {
+        babble_mutex_lock(&set->resize_lock);
+        free_retired(set);
+        babble_mutex_unlock(&set->resize_lock);
+    }
+}
+
+/* waits for the end of a resize that froze a slot */
+static void wait_resize(follower_set_t *set)
+{
+    babble_mutex_lock(&set->resize_lock);
+    babble_mutex_unlock(&set->resize_lock);
+}
+
+/* inserts e in table, assuming its client is not present and that
+ * there is a free slot; the table is not visible yet */
+static void table_insert(follower_table_t *table, follower_entry_t *e)
+{
+    unsigned int i = follower_hash(e->client, table->size);
+
+    while (table->slots[i].client != NULL)
+    {
+        i = (i + 1) & (table->size - 1);
+    }
+    table->slots[i] = *e;
+}
+
+/* allocates a new table large enough for set->size + 1 clients and
+ * moves all entries (from the inline array or the old table) into it;
+ * tombstones are dropped on the way. Called with resize_lock held */
+static void follower_set_rehash(follower_set_t *set)
+{
+    follower_entry_t *items = NULL;
+    follower_entry_t e;
+    unsigned int nb_items = 0;
+    unsigned int new_size = FOLLOWER_TABLE_MIN;
+    unsigned int nb_moved = 0;
+    unsigned int i = 0;
+
+    /* freeze the current slots: adds and removals will now fail on
+     * them, and wait for the new table */
+    items = current_items(set, &nb_items);
+    for (i = 0; i < nb_items; i++)
+    {
+        __atomic_fetch_or((uintptr_t *)&items[i].client, FOLLOWER_FROZEN, __ATOMIC_ACQ_REL);
+    }
+
+    /* sized on the live clients only, for a load factor of 1/2 right
+     * after rehashing: a table full of tombstones is rehashed at the
+     * same size, or shrinks */
+    while (new_size < (__atomic_load_n(&set->size, __ATOMIC_ACQUIRE) + 1) * 2)
+    {
+        new_size *= 2;
+    }
+
+    follower_table_t *old_table = set->table;
+    follower_table_t *new_table = calloc(1, sizeof(follower_table_t) + new_size * sizeof(follower_entry_t));
+    mem_account_alloc(MEM_FOLLOWERS, sizeof(follower_table_t) + new_size * sizeof(follower_entry_t));
+    new_table->size = new_size;
+
+    for (i = 0; i < nb_items; i++)
+    {
+        e.client = load_client(&items[i]);
+        e.cursor = items[i].cursor;
+        if (is_live(e.client))
+        {
+            e.client = unfrozen(e.client);
+            table_insert(new_table, &e);
+            nb_moved++;
+        }
+    }
+
+    __atomic_store_n(&set->nb_used, nb_moved, __ATOMIC_RELEASE);
+    __atomic_store_n(&set->table, new_table, __ATOMIC_SEQ_CST);
+
+    /* readers may still be on the old table; the caller being one of
+     * them, the table is freed when it leaves the set at the latest */
+    if (old_table != NULL)
+    {
+        old_table->retired = set->retired;
+        __atomic_store_n(&set->retired, old_table, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* rehashes set unless its storage changed since items was read */
+static void follower_set_grow(follower_set_t *set, follower_entry_t *items)
+{
+    unsigned int nb_items = 0;
+
+    babble_mutex_lock(&set->resize_lock);
+    if (current_items(set, &nb_items) == items)
+    {
+        follower_set_rehash(set);
+    }
+    babble_mutex_unlock(&set->resize_lock);
+}
+
+void follower_set_init(follower_set_t *set)
+{
+    memset(set->inline_items, 0, sizeof(set->inline_items));
+    set->table = NULL;
+    set->nb_used = 0;
+    set->size = 0;
+    set->readers = 0;
+    set->retired = NULL;
+    babble_mutex_init(&set->resize_lock, LOCK_FOLLOWERS_RESIZE);
+}
+
+void follower_set_destroy(follower_set_t *set)
+{
+    free_retired(set);
+    if (set->table != NULL)
+    {
+        free_table(set->table);
+    }
+    babble_mutex_destroy(&set->resize_lock);
+}
+
+/* returns the slot of client in items, NULL if it is not present */
+static follower_entry_t *find_in(follower_set_t *set, follower_entry_t *items, unsigned int nb_items, struct client_bundle *client)
+{
+    struct client_bundle *c = NULL;
+    unsigned int i = 0;
+    unsigned int n = 0;
+
+    i = (items == set->inline_items) ? 0 : follower_hash(client, nb_items);
+
+    for (n = 0; n < nb_items; n++)
+    {
+        c = load_client(&items[i]);
+        if (c == NULL)
+        {
+            break;
+        }
+        if (unfrozen(c) == client)
+        {
+            return &items[i];
+        }
+        i = (i + 1 == nb_items) ? 0 : i + 1;
+    }
+
+    return NULL;
+}
+
+/* adds client in a tombstone of the inline array, or upgrades set to
+ * a hash table if there is none; returns -1 if the add has to be
+ * retried */
+/* without lock, adds only compete for empty slots and the inline
+ * array has none left: under resize_lock, the lookup of client and
+ * the claim of the tombstone cannot race with another add */
+static int inline_reuse(follower_set_t *set, struct client_bundle *client)
+{
+    unsigned int nb_items = 0;
+    unsigned int i = 0;
+    int ret = -1;
+
+    babble_mutex_lock(&set->resize_lock);
+
+    if (current_items(set, &nb_items) == set->inline_items)
+    {
+        if (find_in(set, set->inline_items, nb_items, client) != NULL)
+        {
+            ret = 1;
+        }
+
+        for (i = 0; ret == -1 && i < nb_items; i++)
+        {
+            /* removals leave tombstones untouched */
+            if (load_client(&set->inline_items[i]) == FOLLOWER_TOMBSTONE)
+            {
+                set->inline_items[i].cursor = 0;
+                __atomic_store_n(&set->inline_items[i].client, client, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&set->size, 1, __ATOMIC_ACQ_REL);
+                ret = 0;
+            }
+        }
+
+        if (ret == -1)
+        {
+            follower_set_rehash(set);
+        }
+    }
+
+    babble_mutex_unlock(&set->resize_lock);
+
+    return ret;
+}
+
+static int add_client(follower_set_t *set, struct client_bundle *client)
+{
+    follower_entry_t *items = NULL;
+    struct client_bundle *c = NULL;
+    unsigned int nb_items = 0;
+    unsigned int i = 0;
+    unsigned int n = 0;
+    int ret = 0;
+
+retry:
+    items = current_items(set, &nb_items);
+
+    if (items != set->inline_items
+        && (__atomic_load_n(&set->nb_used, __ATOMIC_ACQUIRE) + 1) * 4 > nb_items * 3)
+    {
+        /* keep the load factor (tombstones included) below 3/4 */
+        follower_set_grow(set, items);
+        goto retry;
+    }
+
+    /* inline items are scanned from the start, the table from the
+     * hash of client; slots never become empty again, so that two
+     * concurrent adds of the same client compete for the same slot.
+     * Tombstones are only reused under resize_lock */
+    i = (items == set->inline_items) ? 0 : follower_hash(client, nb_items);
+
+    for (n = 0; n < nb_items; n++)
+    {
+        c = load_client(&items[i]);
+
+        if (c == NULL)
+        {
+            if (__atomic_compare_exchange_n(&items[i].client, &c, client, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                __atomic_fetch_add(&set->nb_used, 1, __ATOMIC_ACQ_REL);
+                __atomic_fetch_add(&set->size, 1, __ATOMIC_ACQ_REL);
+                return 0;
+            }
+            /* c now holds the client that won the slot */
+        }
+
+        if (is_frozen(c))
+        {
+            wait_resize(set);
+            goto retry;
+        }
+        if (c == client)
+        {
+            return 1;
+        }
+
+        i = (i + 1 == nb_items) ? 0 : i + 1;
+    }
+
+    /* no free slot in the inline array */
+    if ((ret = inline_reuse(set, client)) != -1)
+    {
+        return ret;
+    }
+    goto retry;
+}
+
+int follower_set_add(follower_set_t *set, struct client_bundle *client)
+{
+    int ret = 0;
+
+    enter_set(set);
+    ret = add_client(set, client);
+    leave_set(set);
+
+    return ret;
+}
+
+follower_entry_t *follower_set_find(follower_set_t *set, struct client_bundle *client)
+{
+    follower_entry_t *items = NULL;
+    follower_entry_t *e = NULL;
+    unsigned int nb_items = 0;
+
+    enter_set(set);
+    items = current_items(set, &nb_items);
+    e = find_in(set, items, nb_items, client);
+    leave_set(set);
+
+    return e;
+}
+
+int follower_set_remove(follower_set_t *set, struct client_bundle *client)
+{
+    follower_entry_t *items = NULL;
+    follower_entry_t *e = NULL;
+    struct client_bundle *c = client;
+    unsigned int nb_items = 0;
+    int ret = -1;
+
+    enter_set(set);
+
+    while (ret == -1)
+    {
+        items = current_items(set, &nb_items);
+        e = find_in(set, items, nb_items, client);
+        if (e == NULL)
+        {
+            ret = 1;
+            break;
+        }
+
+        c = client;
+        if (__atomic_compare_exchange_n(&e->client, &c, FOLLOWER_TOMBSTONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_fetch_sub(&set->size, 1, __ATOMIC_ACQ_REL);
+            ret = 0;
+        }
+        else if (!is_frozen(c))
+        {
+            /* removed concurrently */
+            ret = 1;
+        }
+        else
+        {
+            wait_resize(set);
+        }
+    }
+
+    leave_set(set);
+
+    return ret;
+}
+
+int follower_set_contains(follower_set_t *set, struct client_bundle *client)
+{
+    return follower_set_find(set, client) != NULL;
+}
+
+unsigned int follower_set_size(follower_set_t *set)
+{
+    return __atomic_load_n(&set->size, __ATOMIC_ACQUIRE);
+}
+
+void follower_set_iter_init(follower_set_t *set, follower_iter_t *iter)
+{
+    enter_set(set);
+    iter->set = set;
+    iter->items = current_items(set, &iter->nb_items);
+    iter->index = 0;
+}
+
+void follower_set_iter_end(follower_iter_t *iter)
+{
+    leave_set(iter->set);
+    iter->items = NULL;
+    iter->nb_items = 0;
+}
+
+follower_entry_t *follower_set_next_entry(follower_iter_t *iter)
+{
+    follower_entry_t *e = NULL;
+
+    while (iter->index < iter->nb_items)
+    {
+        e = &iter->items[iter->index++];
+        if (is_live(load_client(e)))
+        {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+struct client_bundle *follower_set_next(follower_iter_t *iter)
+{
+    struct client_bundle *c = NULL;
+
+    while (iter->index < iter->nb_items)
+    {
+        c = load_client(&iter->items[iter->index++]);
+        if (is_live(c))
+        {
+            return unfrozen(c);
+        }
+    }
+
+    return NULL;
+}
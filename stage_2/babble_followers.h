@@ -0,0 +1,100 @@
+#ifndef __BABBLE_FOLLOWERS_H__
+#define __BABBLE_FOLLOWERS_H__
+
+#include <pthread.h>
+
+#include "babble_config.h"
+#include "babble_lock.h"
+
+/* forward declaration, defined in babble_types.h */
+struct client_bundle;
+
+/* an element of a follower set */
+typedef struct follower_entry{
+    struct client_bundle *client; /* low bit set while the slot is
+                                   * being moved to a new table */
+    unsigned long cursor; /* per-edge data, managed by the owner of the
+                           * set (used by pull mode, see
+                           * babble_timeline.h) */
+} follower_entry_t;
+
+/* hash table of a follower set */
+typedef struct follower_table{
+    unsigned int size; /* nb of slots (power of 2) */
+    struct follower_table *retired; /* next table in the retired list
+                                     * of the set */
+    follower_entry_t slots[];
+} follower_table_t;
+
+/* set of clients following a client */
+/* small sets are stored in an inline array that is scanned linearly;
+ * when the inline array is full, the set is upgraded to an
+ * open-addressing hash table (linear probing) indexed by the address
+ * of the client bundle */
+/* adds, removals and lookups are lock-free: clients are installed in
+ * empty slots with a CAS, and removed clients leave a tombstone. Only
+ * rehashing takes resize_lock: the slots of the old table are frozen
+ * before being copied, and operations running into a frozen slot
+ * retry on the new table. The tombstones of a table are dropped at
+ * its next rehash; those of the inline array are reused by adds, under
+ * resize_lock */
+/* operations and iterations are counted in readers while they access
+ * the slots: replaced tables are kept in the retired list until no
+ * reader is left */
+/* the fields read by traversals and the counters updated by adds and
+ * removals are on separate cache lines */
+typedef struct follower_set{
+    follower_entry_t inline_items[BABBLE_FOLLOWERS_INLINE];
+    follower_table_t *table; /* NULL as long as the set is inline */
+    unsigned int nb_used BABBLE_CACHELINE_ALIGNED; /* nb of non-empty
+                                                    * slots, including
+                                                    * tombstones */
+    unsigned int size; /* nb of clients in the set */
+    unsigned int readers; /* nb of running operations and iterations */
+    follower_table_t *retired; /* protected by resize_lock */
+    babble_mutex_t resize_lock;
+} follower_set_t;
+
+/* iterator over a snapshot of a follower set */
+typedef struct follower_iter{
+    follower_set_t *set;
+    follower_entry_t *items;
+    unsigned int nb_items;
+    unsigned int index;
+} follower_iter_t;
+
+void follower_set_init(follower_set_t *set);
+void follower_set_destroy(follower_set_t *set);
+
+/* returns 0 if client was added (with a cursor set to 0), 1 if it was
+ * already in the set */
+int follower_set_add(follower_set_t *set, struct client_bundle *client);
+
+/* returns 0 if client was removed, 1 if it was not in the set */
+int follower_set_remove(follower_set_t *set, struct client_bundle *client);
+
+int follower_set_contains(follower_set_t *set, struct client_bundle *client);
+
+/* returns the entry of client, NULL if client is not in the set */
+/* the entry, and its cursor, are only valid if the caller prevents
+ * concurrent adds to the set */
+follower_entry_t *follower_set_find(follower_set_t *set, struct client_bundle *client);
+
+unsigned int follower_set_size(follower_set_t *set);
+
+/* iterates over the set, concurrent adds and removals are allowed: the
+ * clients that were in the set when the iteration started and are not
+ * removed in between are visited */
+/* iter has to be initialized with follower_set_iter_init(), and
+ * released with follower_set_iter_end() (the entries returned are not
+ * valid anymore); the functions return NULL when all clients have
+ * been visited */
+void follower_set_iter_init(follower_set_t *set, follower_iter_t *iter);
+void follower_set_iter_end(follower_iter_t *iter);
+struct client_bundle *follower_set_next(follower_iter_t *iter);
+
+/* same as follower_set_next(), but returns the entry of the client;
+ * same restriction as follower_set_find() regarding the cursor */
+follower_entry_t *follower_set_next_entry(follower_iter_t *iter);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "babble_format.h"
+
+/* indentation of the publications in the timelines */
+#define PUBLICATION_INDENT "    "
+#define PUBLICATION_INDENT_LEN (sizeof(PUBLICATION_INDENT) - 1)
+
+/* "00" to "99", to convert two digits at a time */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t format_ulong(char *buf, unsigned long v)
+{
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    size_t len = 0;
+
+    /* digits are produced from the end */
+    while (v >= 100)
+    {
+        unsigned int pair = (v % 100) * 2;
+
+        v /= 100;
+        p -= 2;
+        p[0] = digit_pairs[pair];
+        p[1] = digit_pairs[pair + 1];
+    }
+    if (v >= 10)
+    {
+        p -= 2;
+        p[0] = digit_pairs[v * 2];
+        p[1] = digit_pairs[v * 2 + 1];
+    }
+    else
+    {
+        *--p = '0' + v;
+    }
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+size_t format_long(char *buf, long v)
+{
+    if (v < 0)
+    {
+        buf[0] = '-';
+        /* -v overflows for LONG_MIN, not the unsigned negation */
+        return 1 + format_ulong(buf + 1, -(unsigned long)v);
+    }
+    return format_ulong(buf, v);
+}
+
+void format_client_prefix(client_bundle_t *client)
+{
+    size_t name_len = strnlen(client->client_name, BABBLE_ID_SIZE);
+
+    /* "    <name>[", replies start after the indentation */
+    memcpy(client->prefix, PUBLICATION_INDENT, PUBLICATION_INDENT_LEN);
+    memcpy(client->prefix + PUBLICATION_INDENT_LEN, client->client_name, name_len);
+    client->prefix[PUBLICATION_INDENT_LEN + name_len] = '[';
+    client->prefix_len = PUBLICATION_INDENT_LEN + name_len + 1;
+}
+
+void fmt_reply_header(fmt_buf_t *f, client_bundle_t *client, long date)
+{
+    fmt_mem(f, client->prefix + PUBLICATION_INDENT_LEN, client->prefix_len - PUBLICATION_INDENT_LEN);
+    fmt_long(f, date);
+    fmt_lit(f, "]: ");
+}
+
+size_t format_publication_len(client_bundle_t *publisher, long date, size_t msg_len)
+{
+    char digits[24];
+
+    return publisher->prefix_len + format_long(digits, date) + 3 + msg_len + 1;
+}
+
+size_t format_publication(char *buf, size_t size, client_bundle_t *publisher, long date, const char *msg, size_t msg_len)
+{
+    fmt_buf_t f;
+
+    fmt_init(&f, buf, size);
+    fmt_mem(&f, publisher->prefix, publisher->prefix_len);
+    fmt_long(&f, date);
+    fmt_lit(&f, "]: ");
+    fmt_mem(&f, msg, msg_len);
+    fmt_lit(&f, "\n");
+
+    return fmt_end(&f);
+}
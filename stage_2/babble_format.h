@@ -0,0 +1,92 @@
+#ifndef __BABBLE_FORMAT_H__
+#define __BABBLE_FORMAT_H__
+
+#include <string.h>
+
+#include "babble_types.h"
+
+/**** Serialization of replies and publications ****/
+
+/* replies are assembled piece by piece with memcpy instead of being
+ * formatted by snprintf(): the constant parts are literals whose size
+ * is known at compile time, numbers are converted by format_long(),
+ * and the "<name>[" prefix of each client is formatted once at login
+ * (see format_client_prefix()). The output is the same as with
+ * snprintf(): at most size-1 characters followed by '\0' */
+
+/* output buffer being filled */
+typedef struct fmt_buf{
+    char *buf;
+    size_t size; /* size of buf, including the final '\0' */
+    size_t len; /* nb of characters written */
+} fmt_buf_t;
+
+static inline void fmt_init(fmt_buf_t *f, char *buf, size_t size)
+{
+    f->buf = buf;
+    f->size = size;
+    f->len = 0;
+}
+
+/* appends n bytes of data, truncated to the room left */
+static inline void fmt_mem(fmt_buf_t *f, const void *data, size_t n)
+{
+    size_t room = f->size - 1 - f->len;
+
+    if (n > room)
+    {
+        n = room;
+    }
+    memcpy(f->buf + f->len, data, n);
+    f->len += n;
+}
+
+/* appends a string literal */
+#define fmt_lit(f, lit) fmt_mem((f), (lit), sizeof(lit) - 1)
+
+static inline void fmt_str(fmt_buf_t *f, const char *str)
+{
+    fmt_mem(f, str, strlen(str));
+}
+
+/* writes the decimal representation of v in buf (no '\0'), returns its
+ * length; buf must hold at least 20 characters */
+size_t format_ulong(char *buf, unsigned long v);
+size_t format_long(char *buf, long v);
+
+static inline void fmt_long(fmt_buf_t *f, long v)
+{
+    char digits[24];
+
+    fmt_mem(f, digits, format_long(digits, v));
+}
+
+static inline void fmt_ulong(fmt_buf_t *f, unsigned long v)
+{
+    char digits[24];
+
+    fmt_mem(f, digits, format_ulong(digits, v));
+}
+
+/* terminates the output, returns its length */
+static inline size_t fmt_end(fmt_buf_t *f)
+{
+    f->buf[f->len] = '\0';
+    return f->len;
+}
+
+/* formats the cached prefixes of client, once its name is set */
+void format_client_prefix(client_bundle_t *client);
+
+/* starts a reply of client: "<name>[<date>]: " */
+void fmt_reply_header(fmt_buf_t *f, client_bundle_t *client, long date);
+
+/* writes "    <name>[<date>]: <msg>\n", the line of a publication in the
+ * timelines; returns its length */
+size_t format_publication(char *buf, size_t size, client_bundle_t *publisher, long date, const char *msg, size_t msg_len);
+
+/* length of the line written by format_publication() (without the
+ * final '\0') when it is not truncated */
+size_t format_publication_len(client_bundle_t *publisher, long date, size_t msg_len);
+
+#endif
@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "babble_histogram.h"
+
+/* values below HISTOGRAM_SUB_BUCKETS have their own bucket; above,
+ * value v whose most significant bit is b goes to the bucket of
+ * v >> (b - SUB_BITS), in the group of buckets of that power of two */
+static unsigned int bucket_index(uint64_t v)
+{
+    unsigned int msb, shift;
+
+    if (v < HISTOGRAM_SUB_BUCKETS)
+    {
+        return v;
+    }
+    if (v >> BABBLE_HISTOGRAM_MAX_BITS)
+    {
+        return HISTOGRAM_NB_BUCKETS - 1;
+    }
+
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - BABBLE_HISTOGRAM_SUB_BITS;
+
+    return shift * HISTOGRAM_SUB_BUCKETS + (v >> shift);
+}
+
+/* largest value recorded in bucket i */
+static uint64_t bucket_upper(unsigned int i)
+{
+    unsigned int shift;
+    uint64_t mantissa;
+
+    if (i < 2 * HISTOGRAM_SUB_BUCKETS)
+    {
+        return i;
+    }
+
+    shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+    mantissa = i - shift * HISTOGRAM_SUB_BUCKETS;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void histogram_init(histogram_t *h)
+{
+    memset(h, 0, sizeof(histogram_t));
+}
+
+void histogram_record(histogram_t *h, uint64_t v)
+{
+    h->buckets[bucket_index(v)]++;
+    h->count++;
+    h->sum += v;
+}
+
+void histogram_record_atomic(histogram_t *h, uint64_t v)
+{
+    __atomic_fetch_add(&h->buckets[bucket_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+}
+
+void histogram_add(histogram_t *dst, histogram_t *src)
+{
+    unsigned int i = 0;
+    uint64_t n = 0;
+
+    /* the count is rebuilt from the buckets, so that it is consistent
+     * with them even if src is being updated */
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    {
+        n = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+        dst->buckets[i] += n;
+        dst->count += n;
+    }
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+void histogram_sub(histogram_t *dst, histogram_t *src)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    {
+        dst->buckets[i] -= src->buckets[i];
+    }
+    dst->count -= src->count;
+    dst->sum -= src->sum;
+}
+
+uint64_t histogram_percentile(histogram_t *h, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+    unsigned int i = 0;
+
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            return bucket_upper(i);
+        }
+    }
+
+    return bucket_upper(HISTOGRAM_NB_BUCKETS - 1);
+}
+
+uint64_t histogram_count_le(histogram_t *h, uint64_t v)
+{
+    uint64_t n = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS && bucket_upper(i) <= v; i++)
+    {
+        n += h->buckets[i];
+    }
+
+    return n;
+}
+
+uint64_t histogram_max(histogram_t *h)
+{
+    int i = 0;
+
+    for (i = HISTOGRAM_NB_BUCKETS - 1; i >= 0; i--)
+    {
+        if (h->buckets[i] != 0)
+        {
+            return bucket_upper(i);
+        }
+    }
+
+    return 0;
+}
+
+uint64_t histogram_mean(histogram_t *h)
+{
+    return (h->count == 0) ? 0 : h->sum / h->count;
+}
@@ -0,0 +1,53 @@
+#ifndef __BABBLE_HISTOGRAM_H__
+#define __BABBLE_HISTOGRAM_H__
+
+#include <stdint.h>
+
+#include "babble_config.h"
+
+/**** Latency histograms ****/
+
+/* HDR-style log-linear histograms: each power of two is split into
+ * 2^BABBLE_HISTOGRAM_SUB_BITS buckets, so that any recorded value is
+ * known within a relative error of 2^-BABBLE_HISTOGRAM_SUB_BITS.
+ * Values of 2^BABBLE_HISTOGRAM_MAX_BITS and more are recorded in the
+ * last bucket. Used by the server (see babble_stats.h) and by the
+ * test clients. */
+
+#define HISTOGRAM_SUB_BUCKETS (1 << BABBLE_HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NB_BUCKETS ((BABBLE_HISTOGRAM_MAX_BITS - BABBLE_HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram{
+    uint64_t count;  /* nb of recorded values */
+    uint64_t sum;    /* sum of the recorded values */
+    uint64_t buckets[HISTOGRAM_NB_BUCKETS];
+} histogram_t;
+
+void histogram_init(histogram_t *h);
+
+/* records value v; histogram_record_atomic() may be called
+ * concurrently on the same histogram */
+void histogram_record(histogram_t *h, uint64_t v);
+void histogram_record_atomic(histogram_t *h, uint64_t v);
+
+/* adds the values of src to dst; src may be updated concurrently */
+void histogram_add(histogram_t *dst, histogram_t *src);
+
+/* removes the values of src from dst (src has to be a past state of
+ * dst) */
+void histogram_sub(histogram_t *dst, histogram_t *src);
+
+/* returns (an upper bound of) the value below which lie p percents of
+ * the recorded values, 0 if the histogram is empty */
+uint64_t histogram_percentile(histogram_t *h, double p);
+
+/* nb of recorded values lower than or equal to v; values recorded in
+ * the bucket containing v are not counted, unless v is its upper bound */
+uint64_t histogram_count_le(histogram_t *h, uint64_t v);
+
+/* upper bound of the largest recorded value */
+uint64_t histogram_max(histogram_t *h);
+
+uint64_t histogram_mean(histogram_t *h);
+
+#endif
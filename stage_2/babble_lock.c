@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "babble_lock.h"
+#include "babble_format.h"
+
+#ifdef BABBLE_LOCK_PROFILING
+
+typedef struct lock_counters
+{
+    uint64_t nb_acquired;
+    uint64_t nb_contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+} lock_counters_t;
+
+/* the instances of a class with the longest waits; the values are
+ * copied, as the instance may be destroyed before the report */
+typedef struct lock_instance
+{
+    const void *instance;
+    char label[BABBLE_ID_SIZE];
+    uint64_t nb_acquired;
+    uint64_t nb_contended;
+    uint64_t wait_ns;
+} lock_instance_t;
+
+/* the counters of the classes are sharded like the statistics, and so
+ * are the top instances, which are merged by the report */
+typedef struct lock_shard
+{
+    lock_counters_t classes[NB_LOCK_CLASSES];
+    pthread_mutex_t top_lock;
+    lock_instance_t top[NB_LOCK_CLASSES][BABBLE_LOCK_TOP];
+} BABBLE_CACHELINE_ALIGNED lock_shard_t;
+
+static lock_shard_t lock_shards[BABBLE_STATS_SHARDS];
+static unsigned int next_shard = 0;
+static __thread lock_shard_t *my_shard = NULL;
+
+/* the last contended acquisition of the thread, copied while the
+ * mutex is held and added to the top instances after its release */
+static __thread lock_instance_t pending;
+static __thread lock_class_t pending_cls;
+__thread int lock_top_pending = 0;
+
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void)
+{
+    int i = 0;
+
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        pthread_mutex_init(&lock_shards[i].top_lock, NULL);
+    }
+}
+
+uint64_t lock_now(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return (uint64_t)tt.tv_sec * 1000000000ULL + tt.tv_nsec;
+}
+
+static lock_shard_t *get_shard(void)
+{
+    if (my_shard == NULL)
+    {
+        pthread_once(&shards_once, init_shards);
+        my_shard = &lock_shards[__sync_fetch_and_add(&next_shard, 1) % BABBLE_STATS_SHARDS];
+    }
+    return my_shard;
+}
+
+static lock_counters_t *class_counters(lock_class_t cls)
+{
+    return &get_shard()->classes[cls];
+}
+
+/* called with m held: only copies its counters. If the thread
+ * already has a pending instance (it got a mutex while holding
+ * another one), the one with the longest wait is kept */
+static void snapshot_top(babble_mutex_t *m)
+{
+    if (lock_top_pending && pending.wait_ns >= m->wait_ns)
+    {
+        return;
+    }
+
+    pending.instance = m;
+    strncpy(pending.label, (m->label != NULL) ? m->label : "", BABBLE_ID_SIZE - 1);
+    pending.nb_acquired = m->nb_acquired;
+    pending.nb_contended = m->nb_contended;
+    pending.wait_ns = m->wait_ns;
+    pending_cls = m->cls;
+    lock_top_pending = 1;
+}
+
+void lock_update_top(void)
+{
+    lock_shard_t *shard = get_shard();
+    lock_instance_t *top = shard->top[pending_cls];
+    lock_instance_t *slot = NULL;
+    int i = 0;
+
+    lock_top_pending = 0;
+
+    pthread_mutex_lock(&shard->top_lock);
+    for (i = 0; i < BABBLE_LOCK_TOP; i++)
+    {
+        if (top[i].instance == pending.instance)
+        {
+            slot = &top[i];
+            break;
+        }
+        if (slot == NULL || top[i].wait_ns < slot->wait_ns)
+        {
+            slot = &top[i];
+        }
+    }
+
+    if (slot->instance == pending.instance || slot->wait_ns < pending.wait_ns)
+    {
+        *slot = pending;
+    }
+    pthread_mutex_unlock(&shard->top_lock);
+}
+
+void lock_acquired(babble_mutex_t *m, int contended, uint64_t wait_ns)
+{
+    lock_counters_t *c = class_counters(m->cls);
+
+    m->acquired_at = lock_now();
+    m->nb_acquired++;
+    __atomic_fetch_add(&c->nb_acquired, 1, __ATOMIC_RELAXED);
+
+    if (contended)
+    {
+        m->nb_contended++;
+        m->wait_ns += wait_ns;
+        __atomic_fetch_add(&c->nb_contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&c->wait_ns, wait_ns, __ATOMIC_RELAXED);
+        snapshot_top(m);
+    }
+}
+
+void lock_released(babble_mutex_t *m)
+{
+    __atomic_fetch_add(&class_counters(m->cls)->hold_ns, lock_now() - m->acquired_at, __ATOMIC_RELAXED);
+}
+
+static const char *class_names[NB_LOCK_CLASSES] = LOCK_CLASS_NAMES;
+
+static void format_hex(fmt_buf_t *f, uintptr_t v)
+{
+    char digits[2 * sizeof(uintptr_t)];
+    int n = sizeof(digits);
+
+    do
+    {
+        digits[--n] = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+    } while (v != 0);
+
+    fmt_lit(f, "0x");
+    fmt_mem(f, digits + n, sizeof(digits) - n);
+}
+
+static int compare_instances(const void *a, const void *b)
+{
+    const lock_instance_t *i1 = a;
+    const lock_instance_t *i2 = b;
+
+    /* by instance, the longest wait (the latest copy) first */
+    if (i1->instance != i2->instance)
+    {
+        return ((uintptr_t)i1->instance > (uintptr_t)i2->instance) - ((uintptr_t)i1->instance < (uintptr_t)i2->instance);
+    }
+    return (i1->wait_ns < i2->wait_ns) - (i1->wait_ns > i2->wait_ns);
+}
+
+static int compare_waits(const void *a, const void *b)
+{
+    const lock_instance_t *i1 = a;
+    const lock_instance_t *i2 = b;
+
+    return (i1->wait_ns < i2->wait_ns) - (i1->wait_ns > i2->wait_ns);
+}
+
+/* merges the top instances of cls of all shards into top; returns
+ * their nb */
+static int merge_top(lock_class_t cls, lock_instance_t *top)
+{
+    int nb = 0, merged = 0, i = 0;
+
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        pthread_mutex_lock(&lock_shards[i].top_lock);
+        memcpy(&top[nb], lock_shards[i].top[cls], sizeof(lock_shards[i].top[cls]));
+        pthread_mutex_unlock(&lock_shards[i].top_lock);
+        nb += BABBLE_LOCK_TOP;
+    }
+
+    /* an instance used by several threads may be in several shards */
+    qsort(top, nb, sizeof(lock_instance_t), compare_instances);
+    for (i = 0; i < nb; i++)
+    {
+        if (top[i].instance != NULL && (merged == 0 || top[merged - 1].instance != top[i].instance))
+        {
+            top[merged++] = top[i];
+        }
+    }
+
+    qsort(top, merged, sizeof(lock_instance_t), compare_waits);
+    return (merged < BABBLE_LOCK_TOP) ? merged : BABBLE_LOCK_TOP;
+}
+
+void lock_format_report(fmt_buf_t *f)
+{
+    lock_instance_t top[BABBLE_STATS_SHARDS * BABBLE_LOCK_TOP];
+    lock_counters_t total;
+    int cls = 0, i = 0, nb = 0;
+
+    pthread_once(&shards_once, init_shards);
+    fmt_lit(f, "locks, times in ns\n");
+
+    for (cls = 0; cls < NB_LOCK_CLASSES; cls++)
+    {
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+        {
+            total.nb_acquired += __atomic_load_n(&lock_shards[i].classes[cls].nb_acquired, __ATOMIC_RELAXED);
+            total.nb_contended += __atomic_load_n(&lock_shards[i].classes[cls].nb_contended, __ATOMIC_RELAXED);
+            total.wait_ns += __atomic_load_n(&lock_shards[i].classes[cls].wait_ns, __ATOMIC_RELAXED);
+            total.hold_ns += __atomic_load_n(&lock_shards[i].classes[cls].hold_ns, __ATOMIC_RELAXED);
+        }
+
+        fmt_str(f, class_names[cls]);
+        fmt_lit(f, " acquired=");
+        fmt_ulong(f, total.nb_acquired);
+        fmt_lit(f, " contended=");
+        fmt_ulong(f, total.nb_contended);
+        fmt_lit(f, " wait=");
+        fmt_ulong(f, total.wait_ns);
+        fmt_lit(f, " hold=");
+        fmt_ulong(f, total.hold_ns);
+        fmt_lit(f, " avg_hold=");
+        fmt_ulong(f, (total.nb_acquired == 0) ? 0 : total.hold_ns / total.nb_acquired);
+        fmt_lit(f, "\n");
+
+        /* the instances of the class that waited the most */
+        nb = merge_top(cls, top);
+        for (i = 0; i < nb; i++)
+        {
+            fmt_lit(f, "    ");
+            format_hex(f, (uintptr_t)top[i].instance);
+            if (top[i].label[0] != '\0')
+            {
+                fmt_lit(f, " (");
+                fmt_str(f, top[i].label);
+                fmt_lit(f, ")");
+            }
+            fmt_lit(f, " acquired=");
+            fmt_ulong(f, top[i].nb_acquired);
+            fmt_lit(f, " contended=");
+            fmt_ulong(f, top[i].nb_contended);
+            fmt_lit(f, " wait=");
+            fmt_ulong(f, top[i].wait_ns);
+            fmt_lit(f, "\n");
+        }
+    }
+}
+
+void lock_reset(void)
+{
+    lock_counters_t *c = NULL;
+    int i = 0, cls = 0;
+
+    /* the counters of the instances are kept, their next contended
+     * acquisition brings them back in the top instances */
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        for (cls = 0; cls < NB_LOCK_CLASSES; cls++)
+        {
+            c = &lock_shards[i].classes[cls];
+            __atomic_store_n(&c->nb_acquired, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&c->nb_contended, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&c->wait_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&c->hold_ns, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_once(&shards_once, init_shards);
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        pthread_mutex_lock(&lock_shards[i].top_lock);
+        memset(lock_shards[i].top, 0, sizeof(lock_shards[i].top));
+        pthread_mutex_unlock(&lock_shards[i].top_lock);
+    }
+}
+
+#else
+
+void lock_format_report(fmt_buf_t *f)
+{
+    fmt_lit(f, "lock profiling disabled (build with LOCK_PROFILING=1)\n");
+}
+
+void lock_reset(void)
+{
+}
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef __BABBLE_LOCK_H__
+#define __BABBLE_LOCK_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "babble_config.h"
+#include "babble_trace.h"
+
+/**** Mutexes of the server ****/
+
+/* all the mutexes of the server are babble_mutex_t. Without
+ * BABBLE_LOCK_PROFILING (see Makefile), they are plain pthread mutexes.
+ * With it, each mutex belongs to a class, and each class counts its
+ * acquisitions, contended acquisitions (the mutex was held), the time
+ * spent waiting for the mutex and the time it was held. The instances
+ * with the longest waits of each class are also tracked, per shard,
+ * after their release. The report
+ * is returned by the STATS LOCKS command. When tracing is enabled
+ * (see babble_trace.h), contended acquisitions are traced. */
+
+typedef enum{
+    LOCK_REGISTRATION = 0, /* registration_mutex */
+    LOCK_CMD_BUFF,         /* buff_mutex */
+    LOCK_CMD,              /* cmdlock of each client */
+    LOCK_FOLLOWING,        /* following_lock of each client */
+    LOCK_FOLLOWERS_RESIZE, /* resize_lock of each follower set */
+    LOCK_FANOUT_QUEUE,     /* queue of the fan-out workers */
+    LOCK_FANOUT_JOB,       /* lock of each fan-out job */
+    LOCK_SLAB,             /* depot of each slab cache */
+    LOCK_STATS,            /* stats_lock */
+    NB_LOCK_CLASSES
+} lock_class_t;
+
+#define LOCK_CLASS_NAMES {                                              \
+    "registration", "cmd_buff", "cmdlock", "following_lock",           \
+    "followers_resize", "fanout_queue", "fanout_job", "slab", "stats"}
+
+typedef struct babble_mutex{
+    pthread_mutex_t mutex; /* first, so that the mutex can be used
+                            * as a pthread_mutex_t */
+    lock_class_t cls;
+#ifdef BABBLE_LOCK_PROFILING
+    const char *label;     /* optional name of the instance */
+    /* updated by the holder only */
+    uint64_t acquired_at;
+    uint64_t nb_acquired;
+    uint64_t nb_contended;
+    uint64_t wait_ns;
+#endif
+} babble_mutex_t;
+
+#ifdef BABBLE_LOCK_PROFILING
+
+#define BABBLE_MUTEX_INITIALIZER(cls) {PTHREAD_MUTEX_INITIALIZER, (cls), NULL, 0, 0, 0, 0}
+
+uint64_t lock_now(void);
+
+/* accounts an acquisition of m, after waiting wait_ns if it was
+ * contended */
+void lock_acquired(babble_mutex_t *m, int contended, uint64_t wait_ns);
+
+/* accounts the release of m */
+void lock_released(babble_mutex_t *m);
+
+/* set by a contended acquisition, whose mutex is added to the top
+ * instances by lock_update_top() once released, so that the top
+ * instances are never updated in a critical section */
+extern __thread int lock_top_pending;
+void lock_update_top(void);
+
+static inline void babble_mutex_init(babble_mutex_t *m, lock_class_t cls)
+{
+    pthread_mutex_init(&m->mutex, NULL);
+    m->cls = cls;
+    m->label = NULL;
+    m->acquired_at = 0;
+    m->nb_acquired = 0;
+    m->nb_contended = 0;
+    m->wait_ns = 0;
+}
+
+/* label has to live as long as m */
+static inline void babble_mutex_set_label(babble_mutex_t *m, const char *label)
+{
+    m->label = label;
+}
+
+static inline void babble_mutex_lock(babble_mutex_t *m)
+{
+    uint64_t start, wait;
+
+    if (pthread_mutex_trylock(&m->mutex) == 0)
+    {
+        lock_acquired(m, 0, 0);
+        return;
+    }
+
+    start = lock_now();
+    pthread_mutex_lock(&m->mutex);
+    wait = lock_now() - start;
+    lock_acquired(m, 1, wait);
+#ifdef BABBLE_TRACE
+    if (__builtin_expect(trace_enabled, 0))
+    {
+        trace_record(TRACE_LOCK_WAIT, start, wait, (uintptr_t)m, m->cls);
+    }
+#endif
+}
+
+static inline void babble_mutex_unlock(babble_mutex_t *m)
+{
+    lock_released(m);
+    pthread_mutex_unlock(&m->mutex);
+    if (__builtin_expect(lock_top_pending, 0))
+    {
+        lock_update_top();
+    }
+}
+
+/* the time spent waiting on cond is not counted as held */
+static inline void babble_cond_wait(pthread_cond_t *cond, babble_mutex_t *m)
+{
+    lock_released(m);
+    pthread_cond_wait(cond, &m->mutex);
+    m->acquired_at = lock_now();
+}
+
+#else
+
+#define BABBLE_MUTEX_INITIALIZER(cls) {PTHREAD_MUTEX_INITIALIZER, (cls)}
+
+static inline void babble_mutex_init(babble_mutex_t *m, lock_class_t cls)
+{
+    pthread_mutex_init(&m->mutex, NULL);
+    m->cls = cls;
+}
+
+static inline void babble_mutex_set_label(babble_mutex_t *m, const char *label)
+{
+}
+
+static inline void babble_mutex_lock(babble_mutex_t *m)
+{
+#ifdef BABBLE_TRACE
+    uint64_t start;
+
+    if (__builtin_expect(trace_enabled, 0))
+    {
+        if (pthread_mutex_trylock(&m->mutex) != 0)
+        {
+            start = trace_now();
+            pthread_mutex_lock(&m->mutex);
+            trace_record(TRACE_LOCK_WAIT, start, trace_now() - start, (uintptr_t)m, m->cls);
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&m->mutex);
+}
+
+static inline void babble_mutex_unlock(babble_mutex_t *m)
+{
+    pthread_mutex_unlock(&m->mutex);
+}
+
+static inline void babble_cond_wait(pthread_cond_t *cond, babble_mutex_t *m)
+{
+    pthread_cond_wait(cond, &m->mutex);
+}
+
+#endif
+
+static inline void babble_mutex_destroy(babble_mutex_t *m)
+{
+    pthread_mutex_destroy(&m->mutex);
+}
+
+struct fmt_buf;
+
+/* writes the counters of each class, and its top instances */
+void lock_format_report(struct fmt_buf *f);
+
+/* clears the counters of the classes */
+void lock_reset(void);
+
+#endif
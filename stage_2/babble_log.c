@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "babble_log.h"
+
+int log_level = BABBLE_LOG_LEVEL;
+
+typedef struct log_entry
+{
+    uint64_t date;              /* ns since the epoch, formatted by the writer */
+    int level;
+    unsigned int nb_suppressed; /* messages of the site dropped before this one */
+    char msg[BABBLE_LOG_MSG_SIZE];
+} log_entry_t;
+
+/* single producer (the owning thread), single consumer (the writer) */
+typedef struct log_ring
+{
+    unsigned long head BABBLE_CACHELINE_ALIGNED; /* written by the producer */
+    unsigned long nb_dropped;
+    unsigned long tail BABBLE_CACHELINE_ALIGNED; /* written by the writer */
+    unsigned long collected;    /* head seen by the writer, private to it */
+    int in_use;                 /* set while a thread owns the ring */
+    struct log_ring *next;
+    log_entry_t entries[BABBLE_LOG_RING_SIZE];
+} log_ring_t;
+
+/* rings are never freed: the ring of an exiting thread is adopted by
+ * the next thread that logs */
+static log_ring_t *ring_list = NULL;
+
+static __thread log_ring_t *my_ring = NULL;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t log_start = 0;
+static pthread_t writer_thread;
+
+static const char *level_names[] = {"error", "warning", "info", "debug"};
+
+static uint64_t log_now(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_REALTIME, &tt);
+    return (uint64_t)tt.tv_sec * 1000000000ULL + tt.tv_nsec;
+}
+
+static void release_ring(void *arg)
+{
+    log_ring_t *ring = arg;
+
+    /* destructors running after this one must not log into a ring
+     * another thread may have adopted */
+    my_ring = NULL;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/* returns the ring of the calling thread, adopting or creating one */
+static log_ring_t *get_ring(void)
+{
+    log_ring_t *ring = NULL;
+    int free_ring = 0;
+
+    if (my_ring != NULL)
+    {
+        return my_ring;
+    }
+
+    pthread_once(&ring_key_once, create_ring_key);
+
+    for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (ring == NULL)
+    {
+        if (posix_memalign((void **)&ring, BABBLE_CACHELINE_SIZE, sizeof(log_ring_t)))
+        {
+            return NULL;
+        }
+        ring->head = 0;
+        ring->tail = 0;
+        ring->collected = 0;
+        ring->nb_dropped = 0;
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&ring_list, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/* returns 0 if site exceeded BABBLE_LOG_RATE messages this second */
+static int site_allow(log_site_t *site, uint64_t date)
+{
+    long second = date / 1000000000ULL;
+    long window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+
+    if (window != second
+        && __atomic_compare_exchange_n(&site->window, &window, second, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= BABBLE_LOG_RATE)
+    {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return 1;
+}
+
+void log_write(log_site_t *site, int level, const char *fmt, ...)
+{
+    log_ring_t *ring = NULL;
+    log_entry_t *e = NULL;
+    uint64_t date = log_now();
+    unsigned long head;
+    va_list ap;
+
+    if (!site_allow(site, date) || (ring = get_ring()) == NULL)
+    {
+        return;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == BABBLE_LOG_RING_SIZE)
+    {
+        /* never wait for the writer */
+        __atomic_fetch_add(&ring->nb_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    e = &ring->entries[head % BABBLE_LOG_RING_SIZE];
+    e->date = date;
+    e->level = level;
+    e->nb_suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+    va_start(ap, fmt);
+    vsnprintf(e->msg, BABBLE_LOG_MSG_SIZE, fmt, ap);
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_entry(log_entry_t *e)
+{
+    FILE *stream = (e->level <= LOGLEVEL_WARNING) ? stderr : stdout;
+    uint64_t date = e->date - log_start;
+
+    fprintf(stream, "[%5lu.%06lu] %s: %s", (unsigned long)(date / 1000000000ULL),
+            (unsigned long)(date % 1000000000ULL) / 1000, level_names[e->level], e->msg);
+    if (e->nb_suppressed != 0)
+    {
+        fprintf(stream, " (%u similar messages suppressed)", e->nb_suppressed);
+    }
+    fputc('\n', stream);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const log_entry_t *ea = *(log_entry_t *const *)a;
+    const log_entry_t *eb = *(log_entry_t *const *)b;
+
+    return (ea->date > eb->date) - (ea->date < eb->date);
+}
+
+static void *log_writer(void *arg)
+{
+    struct timespec period = {0, BABBLE_LOG_FLUSH_PERIOD * 1000000L};
+    log_entry_t **pending = NULL;
+    unsigned long nb_pending = 0, capacity = 0;
+    unsigned long tail, head, nb_dropped, i;
+    log_ring_t *ring = NULL;
+
+    while (1)
+    {
+        /* collect the pending entries of all rings */
+        nb_pending = 0;
+        for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        {
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            ring->collected = head;
+            for (tail = ring->tail; tail != head; tail++)
+            {
+                if (nb_pending == capacity)
+                {
+                    capacity = (capacity == 0) ? BABBLE_LOG_RING_SIZE : capacity * 2;
+                    pending = realloc(pending, capacity * sizeof(log_entry_t *));
+                }
+                pending[nb_pending++] = &ring->entries[tail % BABBLE_LOG_RING_SIZE];
+            }
+        }
+
+        if (nb_pending == 0)
+        {
+            nanosleep(&period, NULL);
+            continue;
+        }
+
+        /* each ring is ordered, but threads are interleaved */
+        qsort(pending, nb_pending, sizeof(log_entry_t *), compare_entries);
+        for (i = 0; i < nb_pending; i++)
+        {
+            write_entry(pending[i]);
+        }
+
+        /* give the entries back to their threads */
+        for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        {
+            __atomic_store_n(&ring->tail, ring->collected, __ATOMIC_RELEASE);
+            if ((nb_dropped = __atomic_exchange_n(&ring->nb_dropped, 0, __ATOMIC_RELAXED)) != 0)
+            {
+                fprintf(stderr, "warning: %lu log messages dropped\n", nb_dropped);
+            }
+        }
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    return NULL;
+}
+
+void log_init(void)
+{
+    log_start = log_now();
+    pthread_create(&writer_thread, NULL, log_writer, NULL);
+    pthread_detach(writer_thread);
+}
+
+int log_level_from_str(const char *name)
+{
+    int i = 0;
+
+    for (i = LOGLEVEL_ERROR; i <= LOGLEVEL_DEBUG; i++)
+    {
+        if (!strcmp(name, level_names[i]))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,55 @@
+#ifndef __BABBLE_LOG_H__
+#define __BABBLE_LOG_H__
+
+#include "babble_config.h"
+
+/**** Asynchronous logging of the server ****/
+
+/* each thread formats its messages into its own ring; a background
+ * writer drains the rings and does the actual writes, so that logging
+ * never blocks on stdio. If a ring is full, messages are dropped (and
+ * counted) rather than stalling the thread. */
+
+#define LOGLEVEL_ERROR 0
+#define LOGLEVEL_WARNING 1
+#define LOGLEVEL_INFO 2
+#define LOGLEVEL_DEBUG 3
+
+/* state of a call site, used for rate limiting */
+typedef struct log_site{
+    long window;              /* second of the current window */
+    unsigned int count;       /* messages logged in the window */
+    unsigned int suppressed;  /* messages dropped by the rate limit */
+} log_site_t;
+
+/* messages above this level are not logged */
+extern int log_level;
+
+/* the level check happens before the arguments are evaluated; levels
+ * above BABBLE_LOG_MAX_LEVEL are removed at compile time */
+#define babble_log(level, ...)                                          \
+    do {                                                                \
+        if ((level) <= BABBLE_LOG_MAX_LEVEL && (level) <= log_level) {  \
+            static log_site_t __log_site;                               \
+            log_write(&__log_site, (level), __VA_ARGS__);               \
+        }                                                               \
+    } while (0)
+
+#define log_error(...) babble_log(LOGLEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) babble_log(LOGLEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) babble_log(LOGLEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) babble_log(LOGLEVEL_DEBUG, __VA_ARGS__)
+
+/* starts the writer thread */
+void log_init(void);
+
+/* returns the level named name (error, warning, info or debug), -1 if
+ * there is none */
+int log_level_from_str(const char *name);
+
+/* formats a message into the ring of the calling thread; use the
+ * macros above instead */
+void log_write(log_site_t *site, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -0,0 +1,177 @@
+#include <string.h>
+
+#include "babble_memory.h"
+#include "babble_config.h"
+#include "babble_format.h"
+#include "babble_stats.h"
+#include "babble_lock.h"
+
+typedef struct mem_counters
+{
+    uint64_t alloc_bytes;
+    uint64_t free_bytes;
+    uint64_t nb_allocs;
+    uint64_t nb_frees;
+} mem_counters_t;
+
+typedef struct mem_shard
+{
+    mem_counters_t tags[NB_MEM_TAGS];
+} BABBLE_CACHELINE_ALIGNED mem_shard_t;
+
+static mem_shard_t mem_shards[BABBLE_STATS_SHARDS];
+static unsigned int next_shard = 0;
+static __thread mem_shard_t *my_shard = NULL;
+static __thread unsigned int nb_until_peak = 0;
+
+static uint64_t peaks[NB_MEM_TAGS];
+
+/* state at the last reset, protected by report_lock */
+static babble_mutex_t report_lock = BABBLE_MUTEX_INITIALIZER(LOCK_STATS);
+static mem_counters_t baseline[NB_MEM_TAGS];
+static uint64_t baseline_date = 0;
+
+static const char *tag_names[NB_MEM_TAGS] = {
+    "registration", "followers", "timelines", "answers", "commands", "io"};
+
+static mem_counters_t *tag_counters(mem_tag_t tag)
+{
+    if (my_shard == NULL)
+    {
+        my_shard = &mem_shards[__sync_fetch_and_add(&next_shard, 1) % BABBLE_STATS_SHARDS];
+    }
+    return &my_shard->tags[tag];
+}
+
+static void merge_counters(mem_tag_t tag, mem_counters_t *c)
+{
+    int i = 0;
+
+    memset(c, 0, sizeof(mem_counters_t));
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        c->alloc_bytes += __atomic_load_n(&mem_shards[i].tags[tag].alloc_bytes, __ATOMIC_RELAXED);
+        c->free_bytes += __atomic_load_n(&mem_shards[i].tags[tag].free_bytes, __ATOMIC_RELAXED);
+        c->nb_allocs += __atomic_load_n(&mem_shards[i].tags[tag].nb_allocs, __ATOMIC_RELAXED);
+        c->nb_frees += __atomic_load_n(&mem_shards[i].tags[tag].nb_frees, __ATOMIC_RELAXED);
+    }
+}
+
+/* the shards are read one after the other: an object freed by another
+ * thread than the one that allocated it may be seen freed and not
+ * allocated, hence the check */
+uint64_t mem_live_bytes(mem_tag_t tag)
+{
+    mem_counters_t c;
+
+    merge_counters(tag, &c);
+    return (c.alloc_bytes > c.free_bytes) ? c.alloc_bytes - c.free_bytes : 0;
+}
+
+uint64_t mem_live_objects(mem_tag_t tag)
+{
+    mem_counters_t c;
+
+    merge_counters(tag, &c);
+    return (c.nb_allocs > c.nb_frees) ? c.nb_allocs - c.nb_frees : 0;
+}
+
+const char *mem_tag_name(mem_tag_t tag)
+{
+    return tag_names[tag];
+}
+
+static void update_peak(mem_tag_t tag)
+{
+    uint64_t live = mem_live_bytes(tag);
+    uint64_t peak = __atomic_load_n(&peaks[tag], __ATOMIC_RELAXED);
+
+    while (live > peak && !__atomic_compare_exchange_n(&peaks[tag], &peak, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void mem_init(void)
+{
+    baseline_date = stats_now();
+}
+
+void mem_account_alloc(mem_tag_t tag, size_t size)
+{
+    mem_counters_t *c = tag_counters(tag);
+    int i = 0;
+
+    __atomic_fetch_add(&c->alloc_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->nb_allocs, 1, __ATOMIC_RELAXED);
+
+    if (nb_until_peak-- == 0)
+    {
+        nb_until_peak = BABBLE_MEMORY_PEAK_PERIOD;
+        for (i = 0; i < NB_MEM_TAGS; i++)
+        {
+            update_peak(i);
+        }
+    }
+}
+
+void mem_account_free(mem_tag_t tag, size_t size)
+{
+    mem_counters_t *c = tag_counters(tag);
+
+    __atomic_fetch_add(&c->free_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->nb_frees, 1, __ATOMIC_RELAXED);
+}
+
+void mem_reset(void)
+{
+    int i = 0;
+
+    babble_mutex_lock(&report_lock);
+    for (i = 0; i < NB_MEM_TAGS; i++)
+    {
+        merge_counters(i, &baseline[i]);
+        __atomic_store_n(&peaks[i], 0, __ATOMIC_RELAXED);
+        update_peak(i);
+    }
+    baseline_date = stats_now();
+    babble_mutex_unlock(&report_lock);
+}
+
+void mem_format_report(fmt_buf_t *f)
+{
+    mem_counters_t c;
+    uint64_t elapsed_ms = 0, live = 0, total = 0;
+    int i = 0;
+
+    babble_mutex_lock(&report_lock);
+    elapsed_ms = (stats_now() - baseline_date) / 1000000;
+
+    fmt_lit(f, "memory over ");
+    fmt_ulong(f, elapsed_ms);
+    fmt_lit(f, " ms, in bytes\n");
+
+    for (i = 0; i < NB_MEM_TAGS; i++)
+    {
+        update_peak(i);
+        merge_counters(i, &c);
+        live = (c.alloc_bytes > c.free_bytes) ? c.alloc_bytes - c.free_bytes : 0;
+        total += live;
+
+        fmt_str(f, tag_names[i]);
+        fmt_lit(f, " live=");
+        fmt_ulong(f, live);
+        fmt_lit(f, " objects=");
+        fmt_ulong(f, (c.nb_allocs > c.nb_frees) ? c.nb_allocs - c.nb_frees : 0);
+        fmt_lit(f, " peak=");
+        fmt_ulong(f, __atomic_load_n(&peaks[i], __ATOMIC_RELAXED));
+        fmt_lit(f, " alloc_rate=");
+        fmt_ulong(f, (elapsed_ms == 0) ? 0 : (c.alloc_bytes - baseline[i].alloc_bytes) * 1000 / elapsed_ms);
+        fmt_lit(f, "B/s allocs=");
+        fmt_ulong(f, (elapsed_ms == 0) ? 0 : (c.nb_allocs - baseline[i].nb_allocs) * 1000 / elapsed_ms);
+        fmt_lit(f, "/s\n");
+    }
+
+    fmt_lit(f, "total live=");
+    fmt_ulong(f, total);
+    fmt_lit(f, "\n");
+    babble_mutex_unlock(&report_lock);
+}
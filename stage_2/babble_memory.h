@@ -0,0 +1,49 @@
+#ifndef __BABBLE_MEMORY_H__
+#define __BABBLE_MEMORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**** Memory accounting ****/
+
+/* the allocations of the server are accounted per subsystem, in
+ * sharded counters (like the statistics), so that allocating never
+ * takes a lock. The shards are read one after the other, so the live
+ * bytes are approximate while allocations are in flight (a free may
+ * be seen before its allocation, the result is then clamped at 0);
+ * the peak is sampled every BABBLE_MEMORY_PEAK_PERIOD allocations of
+ * each thread, and at each report. Sizes are the sizes requested, without the
+ * overhead of malloc() or of the slabs. The report is returned by the
+ * STATS MEMORY command. */
+
+typedef enum{
+    MEM_REGISTRATION = 0, /* client bundles */
+    MEM_FOLLOWERS,        /* tables of the follower sets */
+    MEM_TIMELINES,        /* timelines and publications */
+    MEM_ANSWERS,          /* answers and their arenas */
+    MEM_COMMANDS,         /* commands */
+    MEM_IO,               /* requests being parsed */
+    NB_MEM_TAGS
+} mem_tag_t;
+
+void mem_init(void);
+
+void mem_account_alloc(mem_tag_t tag, size_t size);
+void mem_account_free(mem_tag_t tag, size_t size);
+
+/* live bytes and objects of tag */
+uint64_t mem_live_bytes(mem_tag_t tag);
+uint64_t mem_live_objects(mem_tag_t tag);
+
+const char *mem_tag_name(mem_tag_t tag);
+
+/* restarts the rates, and the peaks from the live bytes */
+void mem_reset(void);
+
+struct fmt_buf;
+
+/* writes a line per subsystem: live bytes and objects, peak,
+ * allocations per second since the last reset */
+void mem_format_report(struct fmt_buf *f);
+
+#endif
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "babble_metrics.h"
+#include "babble_server.h"
+#include "babble_registration.h"
+#include "babble_communication.h"
+#include "babble_stats.h"
+#include "babble_log.h"
+#include "babble_memory.h"
+
+static int metrics_sock = -1;
+static pthread_t metrics_thread;
+static uint64_t metrics_start = 0;
+
+/* upper bounds of the buckets of the exported histograms, in ns */
+static const uint64_t latency_bounds[] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+    100000000, 1000000000};
+
+#define NB_LATENCY_BOUNDS (sizeof(latency_bounds) / sizeof(latency_bounds[0]))
+
+/* writes v / 10^6 with 6 decimals */
+static void fmt_micros(fmt_buf_t *f, uint64_t v)
+{
+    char digits[24];
+    size_t n = format_ulong(digits, v % 1000000);
+
+    fmt_ulong(f, v / 1000000);
+    fmt_lit(f, ".");
+    fmt_mem(f, "000000", 6 - n);
+    fmt_mem(f, digits, n);
+}
+
+static void fmt_header(fmt_buf_t *f, const char *name, const char *type, const char *help)
+{
+    fmt_lit(f, "# HELP ");
+    fmt_str(f, name);
+    fmt_lit(f, " ");
+    fmt_str(f, help);
+    fmt_lit(f, "\n# TYPE ");
+    fmt_str(f, name);
+    fmt_lit(f, " ");
+    fmt_str(f, type);
+    fmt_lit(f, "\n");
+}
+
+static void fmt_sample(fmt_buf_t *f, const char *name, uint64_t v)
+{
+    fmt_str(f, name);
+    fmt_lit(f, " ");
+    fmt_ulong(f, v);
+    fmt_lit(f, "\n");
+}
+
+/* writes name{label="value"} v */
+static void fmt_labelled(fmt_buf_t *f, const char *name, const char *label, const char *value, uint64_t v)
+{
+    fmt_str(f, name);
+    fmt_lit(f, "{");
+    fmt_str(f, label);
+    fmt_lit(f, "=\"");
+    fmt_str(f, value);
+    fmt_lit(f, "\"} ");
+    fmt_ulong(f, v);
+    fmt_lit(f, "\n");
+}
+
+/* writes the series of histogram h */
+static void fmt_histogram(fmt_buf_t *f, const char *name, const char *label, const char *value, histogram_t *h)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i <= NB_LATENCY_BOUNDS; i++)
+    {
+        fmt_str(f, name);
+        fmt_lit(f, "_bucket{");
+        fmt_str(f, label);
+        fmt_lit(f, "=\"");
+        fmt_str(f, value);
+        fmt_lit(f, "\",le=\"");
+        if (i < NB_LATENCY_BOUNDS)
+        {
+            fmt_ulong(f, latency_bounds[i]);
+            fmt_lit(f, "\"} ");
+            fmt_ulong(f, histogram_count_le(h, latency_bounds[i]));
+        }
+        else
+        {
+            fmt_lit(f, "+Inf\"} ");
+            fmt_ulong(f, h->count);
+        }
+        fmt_lit(f, "\n");
+    }
+
+    fmt_str(f, name);
+    fmt_lit(f, "_sum{");
+    fmt_str(f, label);
+    fmt_lit(f, "=\"");
+    fmt_str(f, value);
+    fmt_lit(f, "\"} ");
+    fmt_ulong(f, h->sum);
+    fmt_lit(f, "\n");
+
+    fmt_str(f, name);
+    fmt_lit(f, "_count{");
+    fmt_str(f, label);
+    fmt_lit(f, "=\"");
+    fmt_str(f, value);
+    fmt_lit(f, "\"} ");
+    fmt_ulong(f, h->count);
+    fmt_lit(f, "\n");
+}
+
+static void metrics_format(fmt_buf_t *f)
+{
+    histogram_t h;
+    uint64_t elapsed = stats_now() - metrics_start;
+    uint64_t busy = stats_counter(STATS_EXECUTOR_BUSY);
+    uint64_t capacity = elapsed / 1000000 * BABBLE_EXECUTOR_THREADS; /* in ms */
+    uint64_t dequeued = stats_counter(STATS_DEQUEUED);
+    uint64_t enqueued = stats_counter(STATS_ENQUEUED);
+    int cid = 0, stage = 0, tag = 0;
+
+    fmt_header(f, "babble_registered_clients", "gauge", "Clients currently registered.");
+    fmt_sample(f, "babble_registered_clients", __atomic_load_n(&nb_registered_clients, __ATOMIC_RELAXED));
+
+    fmt_header(f, "babble_cmd_buff_depth", "gauge", "Commands waiting for an executor.");
+    fmt_sample(f, "babble_cmd_buff_depth", (enqueued > dequeued) ? enqueued - dequeued : 0);
+
+    fmt_header(f, "babble_executor_busy_seconds_total", "counter", "Time spent by the executors on commands.");
+    fmt_lit(f, "babble_executor_busy_seconds_total ");
+    fmt_micros(f, busy / 1000);
+    fmt_lit(f, "\n");
+
+    fmt_header(f, "babble_executor_busy_ratio", "gauge", "Fraction of the executor time spent on commands since the start.");
+    fmt_lit(f, "babble_executor_busy_ratio ");
+    fmt_micros(f, (capacity == 0) ? 0 : busy / capacity);
+    fmt_lit(f, "\n");
+
+    fmt_header(f, "babble_commands_total", "counter", "Commands run, per type.");
+    for (cid = 0; cid < STATS_NB_COMMANDS; cid++)
+    {
+        stats_command_histogram(cid, &h);
+        fmt_labelled(f, "babble_commands_total", "type", stats_command_name(cid), h.count);
+    }
+
+    fmt_header(f, "babble_request_bytes_total", "counter", "Bytes of the requests, per command type.");
+    for (cid = 0; cid < STATS_NB_COMMANDS; cid++)
+    {
+        fmt_labelled(f, "babble_request_bytes_total", "type", stats_command_name(cid), stats_counter(STATS_BYTES_IN + cid));
+    }
+
+    fmt_header(f, "babble_answer_bytes_total", "counter", "Bytes of the answers, per command type.");
+    for (cid = 0; cid < STATS_NB_COMMANDS; cid++)
+    {
+        fmt_labelled(f, "babble_answer_bytes_total", "type", stats_command_name(cid), stats_counter(STATS_BYTES_OUT + cid));
+    }
+
+    fmt_header(f, "babble_fanout_edges_total", "counter", "Publications inserted in a timeline.");
+    fmt_sample(f, "babble_fanout_edges_total", stats_counter(STATS_FANOUT_EDGES));
+
+    fmt_header(f, "babble_timeline_overflows_total", "counter", "TIMELINE answers missing publications.");
+    fmt_sample(f, "babble_timeline_overflows_total", stats_counter(STATS_TIMELINE_OVERFLOWS));
+
+    fmt_header(f, "babble_timeline_dropped_total", "counter", "Publications missing from TIMELINE answers.");
+    fmt_sample(f, "babble_timeline_dropped_total", stats_counter(STATS_TIMELINE_DROPPED));
+
+    fmt_header(f, "babble_memory_live_bytes", "gauge", "Bytes allocated, per subsystem.");
+    for (tag = 0; tag < NB_MEM_TAGS; tag++)
+    {
+        fmt_labelled(f, "babble_memory_live_bytes", "subsystem", mem_tag_name(tag), mem_live_bytes(tag));
+    }
+
+    fmt_header(f, "babble_memory_live_objects", "gauge", "Objects allocated, per subsystem.");
+    for (tag = 0; tag < NB_MEM_TAGS; tag++)
+    {
+        fmt_labelled(f, "babble_memory_live_objects", "subsystem", mem_tag_name(tag), mem_live_objects(tag));
+    }
+
+    fmt_header(f, "babble_command_latency_nanoseconds", "histogram", "Execution time of the commands, per type.");
+    for (cid = 0; cid < STATS_NB_COMMANDS; cid++)
+    {
+        stats_command_histogram(cid, &h);
+        fmt_histogram(f, "babble_command_latency_nanoseconds", "type", stats_command_name(cid), &h);
+    }
+
+    fmt_header(f, "babble_stage_latency_nanoseconds", "histogram", "Duration of each stage of the queued commands.");
+    for (stage = 0; stage <= STATS_NB_STAGES; stage++)
+    {
+        stats_stage_histogram(stage, &h);
+        fmt_histogram(f, "babble_stage_latency_nanoseconds", "stage", stats_stage_name(stage), &h);
+    }
+}
+
+static void send_all(int sock, const char *buf, size_t size)
+{
+    ssize_t n = 0;
+
+    while (size > 0 && (n = send(sock, buf, size, MSG_NOSIGNAL)) > 0)
+    {
+        buf += n;
+        size -= n;
+    }
+}
+
+static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+
+static void serve(int sock, char *body)
+{
+    char request[BABBLE_BUFFER_SIZE];
+    char header[BABBLE_BUFFER_SIZE];
+    struct timeval timeout = {1, 0};
+    fmt_buf_t f;
+    ssize_t n = 0;
+    size_t len = 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if ((n = recv(sock, request, sizeof(request) - 1, 0)) <= 0)
+    {
+        return;
+    }
+    request[n] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) && strncmp(request, "GET / ", 6))
+    {
+        send_all(sock, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    fmt_init(&f, body, BABBLE_METRICS_BUFFER_SIZE);
+    metrics_format(&f);
+    len = fmt_end(&f);
+
+    fmt_init(&f, header, sizeof(header));
+    fmt_lit(&f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ");
+    fmt_ulong(&f, len);
+    fmt_lit(&f, "\r\n\r\n");
+
+    send_all(sock, header, fmt_end(&f));
+    send_all(sock, body, len);
+}
+
+static void *metrics_loop(void *arg)
+{
+    char *body = malloc(BABBLE_METRICS_BUFFER_SIZE);
+    int sock = -1;
+
+    while (1)
+    {
+        /* server_connection_accept() would close metrics_sock */
+        if ((sock = accept(metrics_sock, NULL, NULL)) == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                /* until a connection of the clients is closed */
+                log_warning("metrics listener out of file descriptors");
+                usleep(BABBLE_METRICS_RETRY_DELAY * 1000);
+                continue;
+            }
+            log_error("metrics listener failed: %s", strerror(errno));
+            break;
+        }
+        serve(sock, body);
+        close(sock);
+    }
+
+    free(body);
+    return NULL;
+}
+
+int metrics_init(int port)
+{
+    if ((metrics_sock = server_connection_init(port)) == -1)
+    {
+        return -1;
+    }
+
+    metrics_start = stats_now();
+    pthread_create(&metrics_thread, NULL, metrics_loop, NULL);
+    pthread_detach(metrics_thread);
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __BABBLE_METRICS_H__
+#define __BABBLE_METRICS_H__
+
+/**** Metrics endpoint ****/
+
+/* a minimal HTTP listener serving the metrics of the server in the
+ * Prometheus text format (GET /metrics). The metrics are read from the
+ * sharded counters and histograms of babble_stats.h, so that a scrape
+ * never takes the locks of the commands. Requests are served one at a
+ * time by a dedicated thread. */
+
+/* starts the listener on port; returns -1 if the port cannot be
+ * opened */
+int metrics_init(int port);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __BABBLE_PROBES_H__
+#define __BABBLE_PROBES_H__
+
+/**** Static probes ****/
+
+/* USDT probes of the "babble" provider, for perf, bpftrace or
+ * systemtap. They need <sys/sdt.h> (systemtap-sdt-dev) at build time
+ * and are compiled in with -DBABBLE_PROBES (see Makefile); otherwise
+ * they are no-ops. An unused probe is a nop instruction, the arguments
+ * are only read by the attached tools. For instance:
+ *
+ *   bpftrace -e 'usdt:./babble_server.run:babble:command__start
+ *                  { @s[tid] = nsecs; }
+ *                usdt:./babble_server.run:babble:command__done /@s[tid]/
+ *                  { @ns[arg1] = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ *
+ * Probes (arguments):
+ *   command__start (client key, command id)
+ *   command__done  (client key, command id, result)
+ *   cmd__enqueue   (client key, command id)
+ *   cmd__dequeue   (client key, command id, ns spent in cmd_buff)
+ *   timeline__insert (timeline, publication seq)
+ *   registration__lookup (client key, client or NULL)
+ *   answer__send   (client key, nb of bytes)
+ *   answer__sent   (client key, result) */
+
+#if defined(BABBLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BABBLE_HAVE_SDT
+#endif
+#endif
+
+#ifdef BABBLE_HAVE_SDT
+
+#define BABBLE_PROBE2(name, a1, a2) DTRACE_PROBE2(babble, name, a1, a2)
+#define BABBLE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(babble, name, a1, a2, a3)
+
+#else
+
+#define BABBLE_PROBE2(name, a1, a2) do { } while (0)
+#define BABBLE_PROBE3(name, a1, a2, a3) do { } while (0)
+
+#endif
+
+#endif
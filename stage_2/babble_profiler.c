@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/time.h>
+
+#include "babble_profiler.h"
+#include "babble_format.h"
+#include "babble_log.h"
+
+#ifdef BABBLE_PROFILER
+
+__thread int profiler_command = -1;
+
+/* frames of the handler and of the signal trampoline */
+#define PROFILER_SKIPPED_FRAMES 2
+
+typedef struct profiler_sample
+{
+    int command;
+    unsigned int depth;
+    void *pcs[BABBLE_PROFILER_DEPTH]; /* from the leaf */
+} profiler_sample_t;
+
+/* a single-producer single-consumer ring: the owner writes samples
+ * from the signal handler, profiler_format_dump() consumes them */
+typedef struct profiler_ring
+{
+    unsigned long head;
+    unsigned long tail BABBLE_CACHELINE_ALIGNED;
+    int in_use;
+    profiler_sample_t *samples;
+} profiler_ring_t;
+
+/* nothing can be allocated in the handler: the rings are allocated by
+ * profiler_init(), and claimed with a CAS by the first sample of each
+ * thread; as the log rings, the ring of an exiting thread is released
+ * by the destructor of ring_key, and adopted by the next thread
+ * sampled, with its pending samples */
+static profiler_ring_t rings[BABBLE_PROFILER_THREADS];
+static __thread profiler_ring_t *my_ring = NULL;
+static pthread_key_t ring_key;
+
+/* samples dropped since the last dump */
+static unsigned long nb_ring_full = 0;
+static unsigned long nb_no_ring = 0;
+static unsigned int nb_dumps = 0;
+static int profiler_started = 0;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *command_names[] = {
+    "LOGIN", "PUBLISH", "FOLLOW", "TIMELINE", "FOLLOW_COUNT", "RDV",
+    "UNREGISTER", "STATS"};
+
+#define NB_COMMAND_NAMES (sizeof(command_names) / sizeof(command_names[0]))
+
+static void release_ring(void *arg)
+{
+    profiler_ring_t *ring = arg;
+
+    /* a sample taken from now on claims another ring, released by the
+     * next round of destructors */
+    my_ring = NULL;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* called by the handler; with glibc, pthread_setspecific() does not
+ * allocate for the first 32 keys, and ring_key is created early by
+ * profiler_init() */
+static profiler_ring_t *claim_ring(void)
+{
+    int i = 0, free_ring = 0;
+
+    for (i = 0; i < BABBLE_PROFILER_THREADS; i++)
+    {
+        free_ring = 0;
+        if (__atomic_compare_exchange_n(&rings[i].in_use, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            pthread_setspecific(ring_key, &rings[i]);
+            return &rings[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void sigprof_handler(int sig)
+{
+    void *frames[BABBLE_PROFILER_DEPTH + PROFILER_SKIPPED_FRAMES];
+    int saved_errno = errno;
+    profiler_sample_t *s = NULL;
+    unsigned long head;
+    int n = 0;
+
+    if (my_ring == NULL && (my_ring = claim_ring()) == NULL)
+    {
+        __atomic_fetch_add(&nb_no_ring, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+
+    head = my_ring->head;
+    if (head - __atomic_load_n(&my_ring->tail, __ATOMIC_ACQUIRE) >= BABBLE_PROFILER_SAMPLES)
+    {
+        __atomic_fetch_add(&nb_ring_full, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+
+    s = &my_ring->samples[head % BABBLE_PROFILER_SAMPLES];
+    n = backtrace(frames, BABBLE_PROFILER_DEPTH + PROFILER_SKIPPED_FRAMES) - PROFILER_SKIPPED_FRAMES;
+    s->depth = (n > 0) ? n : 0;
+    memcpy(s->pcs, frames + PROFILER_SKIPPED_FRAMES, s->depth * sizeof(void *));
+    s->command = profiler_command;
+
+    __atomic_store_n(&my_ring->head, head + 1, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    const profiler_sample_t *s1 = a;
+    const profiler_sample_t *s2 = b;
+
+    if (s1->command != s2->command)
+    {
+        return (s1->command < s2->command) ? -1 : 1;
+    }
+    if (s1->depth != s2->depth)
+    {
+        return (s1->depth < s2->depth) ? -1 : 1;
+    }
+    return memcmp(s1->pcs, s2->pcs, s1->depth * sizeof(void *));
+}
+
+/* moves the pending samples of all rings to *samples, including the
+ * rings released by their thread; returns their nb */
+static unsigned long collect_samples(profiler_sample_t **samples)
+{
+    unsigned long nb = 0, size = 0, head, tail;
+    int i = 0;
+
+    *samples = NULL;
+    for (i = 0; i < BABBLE_PROFILER_THREADS; i++)
+    {
+        head = __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE);
+        for (tail = rings[i].tail; tail < head; tail++)
+        {
+            if (nb == size)
+            {
+                size = (size == 0) ? BABBLE_PROFILER_SAMPLES : 2 * size;
+                *samples = realloc(*samples, size * sizeof(profiler_sample_t));
+            }
+            (*samples)[nb++] = rings[i].samples[tail % BABBLE_PROFILER_SAMPLES];
+        }
+        __atomic_store_n(&rings[i].tail, head, __ATOMIC_RELEASE);
+    }
+
+    return nb;
+}
+
+/* writes the name of a frame given by backtrace_symbols(), either
+ * "path(function+0x..) [0x..]" or "path(+0x..) [0x..]" */
+static void write_frame(FILE *file, const char *symbol)
+{
+    const char *open = strchr(symbol, '(');
+    const char *plus = NULL;
+    const char *base = NULL;
+
+    if (open == NULL || (plus = strchr(open, '+')) == NULL)
+    {
+        fputs(symbol, file);
+        return;
+    }
+
+    if (plus > open + 1)
+    {
+        fwrite(open + 1, 1, plus - open - 1, file);
+        return;
+    }
+
+    /* not exported: offset in the object */
+    for (base = open; base > symbol && base[-1] != '/'; base--)
+        ;
+    fwrite(base, 1, open - base, file);
+    fwrite(plus, 1, strcspn(plus, ")"), file);
+}
+
+static void write_stack(FILE *file, profiler_sample_t *s, unsigned long count)
+{
+    char **symbols = backtrace_symbols(s->pcs, s->depth);
+    int i = 0;
+
+    if (s->command >= 0 && s->command < (int)NB_COMMAND_NAMES)
+    {
+        fputs(command_names[s->command], file);
+    }
+    else
+    {
+        fputs("no_command", file);
+    }
+
+    for (i = s->depth - 1; i >= 0; i--)
+    {
+        fputc(';', file);
+        if (symbols != NULL)
+        {
+            write_frame(file, symbols[i]);
+        }
+        else
+        {
+            fprintf(file, "%p", s->pcs[i]);
+        }
+    }
+    fprintf(file, " %lu\n", count);
+
+    free(symbols);
+}
+
+void profiler_format_dump(fmt_buf_t *f)
+{
+    char path[BABBLE_BUFFER_SIZE];
+    profiler_sample_t *samples = NULL;
+    unsigned long nb = 0, i = 0, run = 0;
+    FILE *file = NULL;
+
+    if (!__atomic_load_n(&profiler_started, __ATOMIC_ACQUIRE))
+    {
+        fmt_lit(f, "profiler not started (-P option)\n");
+        return;
+    }
+
+    pthread_mutex_lock(&dump_lock);
+
+    snprintf(path, sizeof(path), "babble_profile.%d.%u", (int)getpid(), nb_dumps++);
+    if ((file = fopen(path, "w")) == NULL)
+    {
+        pthread_mutex_unlock(&dump_lock);
+        log_error("could not open profile file %s", path);
+        fmt_lit(f, "could not write the profile\n");
+        return;
+    }
+
+    nb = collect_samples(&samples);
+    qsort(samples, nb, sizeof(profiler_sample_t), compare_samples);
+
+    /* one line per distinct stack */
+    for (i = 0; i < nb; i = run)
+    {
+        for (run = i + 1; run < nb && !compare_samples(&samples[i], &samples[run]); run++)
+            ;
+        write_stack(file, &samples[i], run - i);
+    }
+
+    fclose(file);
+    free(samples);
+    pthread_mutex_unlock(&dump_lock);
+
+    fmt_lit(f, "profile of ");
+    fmt_ulong(f, nb);
+    fmt_lit(f, " samples written to ");
+    fmt_str(f, path);
+    fmt_lit(f, " (dropped since the last dump: ");
+    fmt_ulong(f, __atomic_exchange_n(&nb_ring_full, 0, __ATOMIC_RELAXED));
+    fmt_lit(f, " ring full, ");
+    fmt_ulong(f, __atomic_exchange_n(&nb_no_ring, 0, __ATOMIC_RELAXED));
+    fmt_lit(f, " no free ring)\n");
+}
+
+int profiler_init(unsigned int hz)
+{
+    struct sigaction sa;
+    struct itimerval timer;
+    void *frame = NULL;
+    int i = 0;
+
+    if (hz == 0 || hz > 1000000)
+    {
+        fprintf(stderr, "Error -- invalid profiling frequency %u\n", hz);
+        return -1;
+    }
+
+    pthread_key_create(&ring_key, release_ring);
+    for (i = 0; i < BABBLE_PROFILER_THREADS; i++)
+    {
+        /* the pages are only touched by the threads that are sampled */
+        rings[i].samples = calloc(BABBLE_PROFILER_SAMPLES, sizeof(profiler_sample_t));
+    }
+
+    /* the first call of backtrace() loads libgcc, which is not safe in
+     * a signal handler */
+    backtrace(&frame, 1);
+
+    sa.sa_handler = sigprof_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+
+    timer.it_interval.tv_sec = (hz == 1) ? 1 : 0;
+    timer.it_interval.tv_usec = (hz == 1) ? 0 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    __atomic_store_n(&profiler_started, 1, __ATOMIC_RELEASE);
+    log_info("### profiling at %u Hz", hz);
+
+    return 0;
+}
+
+#else
+
+int profiler_init(unsigned int hz)
+{
+    fprintf(stderr, "Error -- the profiler is not compiled in (build with PROFILER=1)\n");
+    return -1;
+}
+
+void profiler_format_dump(fmt_buf_t *f)
+{
+    fmt_lit(f, "profiler disabled\n");
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __BABBLE_PROFILER_H__
+#define __BABBLE_PROFILER_H__
+
+/**** Sampling profiler ****/
+
+/* when started (-P option of the server), SIGPROF is raised every
+ * 1/hz s of CPU time (setitimer(ITIMER_PROF)) and the handler stores
+ * the backtrace of the interrupted thread in a ring of that thread,
+ * tagged with the command it was running. STATS PROFILE writes the
+ * samples taken since the previous dump as folded stacks
+ * ("COMMAND;root;...;leaf count" lines, see flamegraph.pl) to
+ * babble_profile.<pid>.<n>. The functions are named from the dynamic
+ * symbol table (link with -rdynamic); static functions appear as
+ * offsets in the executable, for addr2line.
+ * The profiler is compiled in with -DBABBLE_PROFILER (see Makefile). */
+
+struct fmt_buf;
+
+/* starts sampling at hz samples per second of CPU time; returns -1 if
+ * the profiler is not compiled in */
+int profiler_init(unsigned int hz);
+
+/* writes the samples to a file, and its name to f */
+void profiler_format_dump(struct fmt_buf *f);
+
+#ifdef BABBLE_PROFILER
+
+/* command run by the thread, -1 if none */
+extern __thread int profiler_command;
+
+#define profiler_set_command(cid) (profiler_command = (cid))
+
+#else
+
+#define profiler_set_command(cid) do { } while (0)
+
+#endif
+
+#endif
@@ -3,10 +3,12 @@
 #include <pthread.h>
 
 #include "babble_registration.h"
+#include "babble_log.h"
+#include "babble_probes.h"
 
 client_bundle_t *registration_table[MAX_CLIENT];
 int nb_registered_clients;
-pthread_mutex_t registration_mutex = PTHREAD_MUTEX_INITIALIZER;
+babble_mutex_t registration_mutex = BABBLE_MUTEX_INITIALIZER(LOCK_REGISTRATION);
 
 void registration_init(void)
 {
@@ -17,7 +19,7 @@ void registration_init(void)
 
 client_bundle_t *registration_lookup(unsigned long key)
 {
-    pthread_mutex_lock(&registration_mutex); // Lock the table
+    babble_mutex_lock(&registration_mutex); // Lock the table
     int i = 0;
     client_bundle_t *c = NULL;
 
@@ -29,17 +31,18 @@ client_bundle_t *registration_lookup(unsigned long key)
             break;
         }
     }
-    pthread_mutex_unlock(&registration_mutex);
+    babble_mutex_unlock(&registration_mutex);
+    BABBLE_PROBE2(registration__lookup, key, c);
     return c;
 }
 
 int registration_insert(client_bundle_t *cl)
 {
-    pthread_mutex_lock(&registration_mutex);
+    babble_mutex_lock(&registration_mutex);
     if (nb_registered_clients == MAX_CLIENT)
     {
-        pthread_mutex_unlock(&registration_mutex);
-        fprintf(stderr, "ERROR: MAX NUMBER OF CLIENTS REACHED\n");
+        babble_mutex_unlock(&registration_mutex);
+        log_error("max number of clients reached");
         return -1;
     }
 
@@ -50,14 +53,14 @@ int registration_insert(client_bundle_t *cl)
     {
         if (registration_table[i]->key == cl->key)
         {
-            pthread_mutex_unlock(&registration_mutex);
+            babble_mutex_unlock(&registration_mutex);
             break;
         }
     }
 
     if (i != nb_registered_clients)
     {
-        fprintf(stderr, "Error -- id % ld already in use\n", cl->key);
+        log_error("id %ld already in use", cl->key);
 
         return -1;
     }
@@ -65,14 +68,14 @@ int registration_insert(client_bundle_t *cl)
     /* insert cl */
     registration_table[nb_registered_clients] = cl;
     nb_registered_clients++;
-    pthread_mutex_unlock(&registration_mutex);
+    babble_mutex_unlock(&registration_mutex);
 
     return 0;
 }
 
 client_bundle_t *registration_remove(unsigned long key)
 {
-    pthread_mutex_lock(&registration_mutex);
+    babble_mutex_lock(&registration_mutex);
     int i = 0;
 
     for (i = 0; i < nb_registered_clients; i++)
@@ -85,8 +88,8 @@ client_bundle_t *registration_remove(unsigned long key)
 
     if (i == nb_registered_clients)
     {
-        pthread_mutex_unlock(&registration_mutex);
-        fprintf(stderr, "Error -- no client found\n");
+        babble_mutex_unlock(&registration_mutex);
+        log_error("no client found");
 
         return NULL;
     }
@@ -95,6 +98,6 @@ client_bundle_t *registration_remove(unsigned long key)
 
     nb_registered_clients--;
     registration_table[i] = registration_table[nb_registered_clients];
-    pthread_mutex_unlock(&registration_mutex);
+    babble_mutex_unlock(&registration_mutex);
     return cl;
 }
@@ -17,6 +17,14 @@
 #include "babble_communication.h"
 #include "babble_server_answer.h"
 #include "babble_registration.h"
+#include "babble_log.h"
+#include "babble_stats.h"
+#include "babble_metrics.h"
+#include "babble_trace.h"
+#include "babble_probes.h"
+#include "babble_profiler.h"
+#include "babble_memory.h"
+#include "babble_topk.h"
 #include "fastrand.h"
 #include "babble_config.h"
 
@@ -25,7 +33,7 @@ static int buff_start = 0;
 static int buff_end = 0;
 
 
-pthread_mutex_t buff_mutex = PTHREAD_MUTEX_INITIALIZER;
+babble_mutex_t buff_mutex = BABBLE_MUTEX_INITIALIZER(LOCK_CMD_BUFF);
 pthread_cond_t buff_not_empty = PTHREAD_COND_INITIALIZER;
 pthread_cond_t buff_not_full = PTHREAD_COND_INITIALIZER;
 
@@ -35,44 +43,49 @@ int random_delay_activated = 0;
 
 static void display_help(char *exec)
 {
-    printf("Usage: %s -p port_number -r [activate_random_delays]\n", exec);
+    printf("Usage: %s -p port_number -r [activate_random_delays] -f fanout_mode -t celebrity_threshold -l log_level -M metrics_port -T slow_ms -P hz\n", exec);
+    printf("\t fanout_mode can be push (default), pull or hybrid\n");
+    printf("\t celebrity_threshold is the initial nb of followers above which a client is pulled in hybrid mode\n");
+    printf("\t log_level can be error, warning, info (default) or debug\n");
+    printf("\t metrics_port is the port of the HTTP metrics endpoint (disabled by default)\n");
+    printf("\t -T enables tracing: the traces are dumped on SIGUSR1 and when a command takes more than slow_ms ms (0 to disable)\n");
+    printf("\t -P samples the stacks of the server hz times per second of CPU time (see STATS PROFILE)\n");
 }
 
-static int parse_command(char *str, command_t *cmd)
+static int parse_command(char *str, size_t len, command_t *cmd)
 {
     char *name = NULL;
+    parsed_request_t req;
 
-    /* start by cleaning the input */
-    str_clean(str);
-
-    /* get command id */
-    cmd->cid = str_to_command(str, &cmd->answer_expected);
+    /* get command id, the input is parsed only once */
+    cmd->cid = parse_request(str, len, &req);
+    cmd->answer_expected = req.ack_req;
 
     switch (cmd->cid)
     {
     case LOGIN:
-        if (str_to_payload(str, cmd->msg, BABBLE_ID_SIZE))
+        if (request_payload(&req, cmd->msg, BABBLE_ID_SIZE))
         {
             name = get_name_from_key(cmd->key);
-            fprintf(stderr, "Error from [%s]-- invalid LOGIN -> %s\n", name, str);
+            log_error("[%s] invalid LOGIN -> %s", name, str);
             free(name);
             return -1;
         }
         break;
     case PUBLISH:
-        if (str_to_payload(str, cmd->msg, BABBLE_PUBLICATION_SIZE))
+        if (request_payload(&req, cmd->msg, BABBLE_PUBLICATION_SIZE))
         {
             name = get_name_from_key(cmd->key);
-            fprintf(stderr, "Warning from [%s]-- invalid PUBLISH -> %s\n", name, str);
+            log_warning("[%s] invalid PUBLISH -> %s", name, str);
             free(name);
             return -1;
         }
         break;
     case FOLLOW:
-        if (str_to_payload(str, cmd->msg, BABBLE_ID_SIZE))
+        if (request_payload(&req, cmd->msg, BABBLE_ID_SIZE))
         {
             name = get_name_from_key(cmd->key);
-            fprintf(stderr, "Warning from [%s]-- invalid FOLLOW -> %s\n", name, str);
+            log_warning("[%s] invalid FOLLOW -> %s", name, str);
             free(name);
             return -1;
         }
@@ -86,9 +99,16 @@ static int parse_command(char *str, command_t *cmd)
     case RDV:
         cmd->msg[0] = '\0';
         break;
+    case STATS:
+        /* optional section or RESET */
+        if (request_payload(&req, cmd->msg, BABBLE_PUBLICATION_SIZE))
+        {
+            cmd->msg[0] = '\0';
+        }
+        break;
     default:
         name = get_name_from_key(cmd->key);
-        fprintf(stderr, "Error from [%s]-- invalid client command -> %s\n", name, str);
+        log_error("[%s] invalid client command -> %s", name, str);
         free(name);
         return -1;
     }
@@ -100,6 +120,11 @@ static int parse_command(char *str, command_t *cmd)
 static int process_command(command_t *cmd, answer_t **answer)
 {
     int res = 0;
+    uint64_t start = stats_now();
+
+    trace_event(TRACE_COMMAND_BEGIN, cmd->key, cmd->cid);
+    BABBLE_PROBE2(command__start, cmd->key, cmd->cid);
+    profiler_set_command(cmd->cid);
 
     switch (cmd->cid)
     {
@@ -128,17 +153,27 @@ static int process_command(command_t *cmd, answer_t **answer)
         res = unregisted_client(cmd);
         *answer = NULL;
         break;
+    case STATS:
+        res = run_stats_command(cmd, answer);
+        break;
     default:
-        fprintf(stderr, "Error -- Unknown command id\n");
+        log_error("unknown command id");
+        profiler_set_command(-1);
         return -1;
     }
 
     if (res)
     {
-        fprintf(stderr, "Error -- Failed to run command ");
-        display_command(cmd, stderr);
+        log_error("failed to run command %d %s", cmd->cid, cmd->msg);
     }
 
+    stats_record_command(cmd->cid, stats_now() - start);
+    log_debug("[%lu] command %d %s -> %d", cmd->key, cmd->cid, cmd->msg, res);
+    topk_record(TOPK_COMMANDS, cmd->key, 1);
+    trace_event(TRACE_COMMAND_END, cmd->key, cmd->cid);
+    BABBLE_PROBE3(command__done, cmd->key, cmd->cid, res);
+    profiler_set_command(-1);
+
     return res;
 }
 
@@ -161,6 +196,13 @@ int is_buff_full()
     return ((buff_end + 1) % BABBLE_BUFFER_SIZE) == buff_start;
 }
 
+/* frees a request returned by network_recv() */
+static void free_request(char *buf, int size)
+{
+    mem_account_free(MEM_IO, size);
+    free(buf);
+}
+
 int is_buffer_empty()
 {
     return buff_start == buff_end;
@@ -172,72 +214,83 @@ void *communication_thread(void *arg)
     int sockfd = *(int *)arg;
     free(arg);
     char *recv_buff = NULL;
+    int recv_size = 0;
     command_t *cmd;
     answer_t *answer = NULL;
     unsigned long cl_key = 0;
     char client_name[BABBLE_ID_SIZE + 1];
 
     memset(client_name, 0, BABBLE_ID_SIZE + 1);
-    if (network_recv(sockfd, (void **)&recv_buff) > 0)
+    if ((recv_size = network_recv(sockfd, (void **)&recv_buff)) > 0)
     {
+        mem_account_alloc(MEM_IO, recv_size);
         cmd = new_command(0);
-        if (parse_command(recv_buff, cmd) == -1 || cmd->cid != LOGIN)
+        if (parse_command(recv_buff, recv_size, cmd) == -1 || cmd->cid != LOGIN)
         {
-            fprintf(stderr, "Error -- in LOGIN message\n");
+            log_error("invalid LOGIN message");
             close(sockfd);
-            free(cmd);
-            free(recv_buff);
+            free_command(cmd);
+            free_request(recv_buff, recv_size);
             return NULL;
         }
 
         cmd->sock = sockfd;
         if (process_command(cmd, &answer) == -1)
         {
-            fprintf(stderr, "Error -- in LOGIN\n");
+            log_error("failed to run LOGIN");
             close(sockfd);
-            free(cmd);
-            free(recv_buff);
+            free_command(cmd);
+            free_request(recv_buff, recv_size);
             return NULL;
         }
 
         cl_key = cmd->key;
+        stats_record_bytes(LOGIN, recv_size, answer->size);
+        topk_record(TOPK_BYTES_SENT, cl_key, answer->size);
         if (send_answer_to_client(answer) == -1)
         {
-            fprintf(stderr, "Error -- in LOGIN ack\n");
+            log_error("failed to send LOGIN ack");
             close(sockfd);
-            free(cmd);
+            free_command(cmd);
             free_answer(answer);
-            free(recv_buff);
+            free_request(recv_buff, recv_size);
             return NULL;
         }
 
         free_answer(answer);
-        free(recv_buff);
+        free_command(cmd);
+        free_request(recv_buff, recv_size);
     }
 
-    while (network_recv(sockfd, (void **)&recv_buff) > 0)
+    while ((recv_size = network_recv(sockfd, (void **)&recv_buff)) > 0)
     {
+        mem_account_alloc(MEM_IO, recv_size);
         cmd = new_command(cl_key);
-        if (parse_command(recv_buff, cmd) == -1)
+        command_stamp(cmd, STAMP_RECV);
+        if (parse_command(recv_buff, recv_size, cmd) == -1)
         {
-            fprintf(stderr, "Warning: unable to parse message\n");
+            log_warning("unable to parse message");
             notify_parse_error(cmd, recv_buff, &answer);
             send_answer_to_client(answer);
             free_answer(answer);
-            free(cmd);
+            free_command(cmd);
         }
         else
         {
-            pthread_mutex_lock(&buff_mutex);
+            cmd->request_size = recv_size;
+            command_stamp(cmd, STAMP_ENQUEUE);
+            babble_mutex_lock(&buff_mutex);
             while (is_buff_full())
             {
-                pthread_cond_wait(&buff_not_full, &buff_mutex);
+                babble_cond_wait(&buff_not_full, &buff_mutex);
             }
+            stats_add(STATS_ENQUEUED, 1);
+            BABBLE_PROBE2(cmd__enqueue, cmd->key, cmd->cid);
             add_to_buff(cmd);
             pthread_cond_signal(&buff_not_empty);
-            pthread_mutex_unlock(&buff_mutex);
+            babble_mutex_unlock(&buff_mutex);
         }
-        free(recv_buff);
+        free_request(recv_buff, recv_size);
     }
 
     // Unregister client on disconnection
@@ -245,9 +298,10 @@ void *communication_thread(void *arg)
     cmd->cid = UNREGISTER;
     if (process_command(cmd, &answer) == -1)
     {
-        fprintf(stderr, "Warning -- failed to unregister client %s\n", client_name);
+        log_warning("failed to unregister client %s", client_name);
     }
-    free(cmd);
+    free_command(cmd);
+    log_debug("[%lu] connection closed", cl_key);
     close(sockfd);
     return NULL;
 }
@@ -257,28 +311,40 @@ void *executor_thread(void *arg)
     fastRandomSetSeed(time(NULL) + pthread_self() * 100);
     while (1)
     {
-        pthread_mutex_lock(&buff_mutex);
+        babble_mutex_lock(&buff_mutex);
         while (is_buffer_empty())
         {
-            pthread_cond_wait(&buff_not_empty, &buff_mutex);
+            babble_cond_wait(&buff_not_empty, &buff_mutex);
         }
         command_t *cmd = rmv_from_buff();
         pthread_cond_signal(&buff_not_full);
-        pthread_mutex_unlock(&buff_mutex);
+        babble_mutex_unlock(&buff_mutex);
+        command_stamp(cmd, STAMP_DEQUEUE);
+        BABBLE_PROBE3(cmd__dequeue, cmd->key, cmd->cid, cmd->dates[STAMP_DEQUEUE] - cmd->dates[STAMP_ENQUEUE]);
+        stats_add(STATS_DEQUEUED, 1);
 
         answer_t *answer = NULL;
         int res = process_command(cmd, &answer);
-        
+        command_stamp(cmd, STAMP_EXECUTED);
+
         if (res == -1)
         {
-            fprintf(stderr, "Warning: unable to process command\n");
+            log_warning("unable to process command");
         }
         if (answer && send_answer_to_client(answer) == -1)
         {
-            fprintf(stderr, "Warning: unable to send answer to client\n");
+            log_warning("unable to send answer to client");
+        }
+        command_stamp(cmd, STAMP_SENT);
+        stats_record_lifecycle(cmd);
+        trace_check_slow(cmd->dates[STAMP_SENT] - cmd->dates[STAMP_RECV]);
+        stats_record_bytes(cmd->cid, cmd->request_size, answer ? answer->size : 0);
+        if (answer)
+        {
+            topk_record(TOPK_BYTES_SENT, cmd->key, answer->size);
         }
         free_answer(answer);
-        free(cmd);
+        free_command(cmd);
     }
     return NULL;
 }
@@ -287,18 +353,59 @@ int main(int argc, char *argv[])
 {
     int sockfd, newsockfd;
     int portno = BABBLE_PORT;
+    int metrics_port = 0;
+    int trace_slow_ms = -1;
+    int profiler_hz = 0;
     int opt;
 
-    while ((opt = getopt(argc, argv, "+hp:r")) != -1)
+    while ((opt = getopt(argc, argv, "+hp:rf:t:l:M:T:P:")) != -1)
     {
         switch (opt)
         {
+        case 'f':
+            if (!strcmp(optarg, "push"))
+            {
+                fanout_mode = FANOUT_PUSH;
+            }
+            else if (!strcmp(optarg, "pull"))
+            {
+                fanout_mode = FANOUT_PULL;
+            }
+            else if (!strcmp(optarg, "hybrid"))
+            {
+                fanout_mode = FANOUT_HYBRID;
+            }
+            else
+            {
+                display_help(argv[0]);
+                return -1;
+            }
+            break;
         case 'p':
             portno = atoi(optarg);
             break;
         case 'r':
             random_delay_activated = 1;
             break;
+        case 't':
+            hybrid_threshold = atoi(optarg);
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            break;
+        case 'T':
+            trace_slow_ms = atoi(optarg);
+            break;
+        case 'P':
+            profiler_hz = atoi(optarg);
+            break;
+        case 'l':
+            if ((log_level = log_level_from_str(optarg)) == -1)
+            {
+                display_help(argv[0]);
+                return -1;
+            }
+            break;
         case 'h':
         default:
             display_help(argv[0]);
@@ -309,6 +416,21 @@ int main(int argc, char *argv[])
     // Initialize server data structures
     server_data_init();
 
+    if (metrics_port != 0 && metrics_init(metrics_port) == -1)
+    {
+        return -1;
+    }
+
+    if (trace_slow_ms >= 0 && trace_init(trace_slow_ms) == -1)
+    {
+        return -1;
+    }
+
+    if (profiler_hz != 0 && profiler_init(profiler_hz) == -1)
+    {
+        return -1;
+    }
+
     // start the exec threads
     for (int i = 0; i < BABBLE_EXECUTOR_THREADS; i++)
     {
@@ -329,6 +451,7 @@ int main(int argc, char *argv[])
         {
             return -1;
         }
+        log_debug("connection accepted on socket %d", newsockfd);
         int *client_sock = malloc(sizeof(int));
         *client_sock = newsockfd;
         pthread_t comm_tid;
@@ -9,6 +9,18 @@
 /* server starting date */
 extern time_t server_start;
 
+/* how publications reach the timelines of the followers */
+typedef enum{
+    FANOUT_PUSH = 0, /* copied into each follower timeline on PUBLISH */
+    FANOUT_PULL,     /* merged from the followed outboxes on TIMELINE */
+    FANOUT_HYBRID    /* push, except for clients with many followers */
+} fanout_mode_t;
+
+extern fanout_mode_t fanout_mode;
+
+/* current follower count above which a client is pulled (hybrid) */
+extern unsigned int hybrid_threshold;
+
 /* init functions */
 void server_data_init(void);
 int server_connection_init(int port);
@@ -16,6 +28,7 @@ int server_connection_accept(int sock);
 
 /* new object */
 command_t* new_command(unsigned long key);
+void free_command(command_t *cmd);
 
 /* operations */
 int run_login_command(command_t *cmd, answer_t **answer);
@@ -24,6 +37,7 @@ int run_follow_command(command_t *cmd, answer_t **answer);
 int run_timeline_command(command_t *cmd, answer_t **answer);
 int run_fcount_command(command_t *cmd, answer_t **answer);
 int run_rdv_command(command_t *cmd, answer_t **answer);
+int run_stats_command(command_t *cmd, answer_t **answer);
 
 int unregisted_client(command_t *cmd);
 
@@ -36,6 +50,9 @@ int notify_parse_error(command_t *cmd, char *input, answer_t **answer);
 /* high level comm function */
 int write_to_client(unsigned long key, int size, void* buf);
 
+/* same, but buf is sent as is, without a size header */
+int write_raw_to_client(unsigned long key, unsigned long size, void* buf);
+
 /* get client name from client key */
 char* get_name_from_key(unsigned long key);
 
@@ -5,14 +5,32 @@
 
 #include "babble_server_answer.h"
 #include "babble_server.h"
+#include "babble_slab.h"
+#include "babble_log.h"
+#include "babble_probes.h"
+#include "babble_memory.h"
+
+/* room for the size and the nb of msgs sent first */
+#define ANSWER_HEADER_SIZE (sizeof(unsigned long) + sizeof(unsigned int))
+
+static slab_cache_t answer_cache;
+
+void answer_init(void)
+{
+    slab_cache_init(&answer_cache, "answer", sizeof(answer_t), __alignof__(answer_t));
+}
 
 answer_t* alloc_answer(unsigned long key)
 {
-    answer_t *a = (answer_t*) malloc(sizeof(answer_t));
+    answer_t *a = (answer_t*) slab_alloc(&answer_cache);
+    mem_account_alloc(MEM_ANSWERS, sizeof(answer_t));
 
     a->key = key;
     a->nb_items = 0;
-    a->first = NULL;
+    a->buf = a->inline_buf;
+    a->size = ANSWER_HEADER_SIZE;
+    a->last_msg = 0;
+    a->capacity = BABBLE_ANSWER_ARENA_SIZE;
 
     return a;
 }
@@ -24,82 +42,87 @@ void free_answer(answer_t *answer)
         return ;
     }
 
-    int count = 0;
-    answer_msg_t *iter = answer->first, *next=NULL;
+    /* the whole arena goes at once */
+    if(answer->buf != answer->inline_buf){
+        mem_account_free(MEM_ANSWERS, answer->capacity);
+        free(answer->buf);
+    }
 
-    
-    while(iter != NULL){
-        next = iter->next;
-        free(iter->buf);
-        free(iter);
-        iter = next;
-        count++;
+    slab_free(&answer_cache, answer);
+    mem_account_free(MEM_ANSWERS, sizeof(answer_t));
+}
+
+void *answer_alloc_msg(answer_t *answer, size_t buf_size)
+{
+    unsigned long header = buf_size;
+    size_t needed = answer->size + sizeof(unsigned long) + buf_size;
+    char *msg = NULL;
+
+    if(needed > answer->capacity){
+        if(answer->buf != answer->inline_buf){
+            mem_account_free(MEM_ANSWERS, answer->capacity);
+        }
+        while(answer->capacity < needed){
+            answer->capacity *= 2;
+        }
+        if(answer->buf == answer->inline_buf){
+            answer->buf = malloc(answer->capacity);
+            memcpy(answer->buf, answer->inline_buf, answer->size);
+        }
+        else{
+            answer->buf = realloc(answer->buf, answer->capacity);
+        }
+        mem_account_alloc(MEM_ANSWERS, answer->capacity);
     }
 
-    assert(count == answer->nb_items);
+    /* the arena is not aligned, the header is copied */
+    memcpy(answer->buf + answer->size, &header, sizeof(unsigned long));
+    msg = answer->buf + answer->size + sizeof(unsigned long);
+    answer->last_msg = answer->size;
+    answer->size = needed;
+    answer->nb_items++;
 
-    free(answer);
+    return msg;
 }
 
-void add_msg_to_answer(answer_t *answer, size_t buf_size, void *buf)
+void answer_trim_msg(answer_t *answer, size_t buf_size)
 {
-    answer_msg_t *iter=NULL;
-    
-    /* the new msg */
-    answer_msg_t *new_msg = malloc(sizeof(answer_msg_t));
-    new_msg->buf = malloc(buf_size);
-    new_msg->size = buf_size;
-    new_msg->next = NULL;
+    unsigned long header = buf_size;
 
-    memcpy(new_msg->buf, buf, buf_size);
+    assert(answer->nb_items > 0);
+    assert(answer->last_msg + sizeof(unsigned long) + buf_size <= answer->size);
 
-    /* case of first msg */
-    if(answer->first == NULL){
-        answer->first = new_msg;
-    }
-    else{
-        /* get to the last in the list */
-        iter = answer->first;
-        
-        while(iter != NULL){
-            if(iter->next == NULL){
-                break;
-            }
-            iter=iter->next;
-        }
+    memcpy(answer->buf + answer->last_msg, &header, sizeof(unsigned long));
+    answer->size = answer->last_msg + sizeof(unsigned long) + buf_size;
+}
 
-        /* add the new msg to the answer */
-        iter->next = new_msg;
-    }
-    
-    answer->nb_items++;    
+void add_msg_to_answer(answer_t *answer, size_t buf_size, void *buf)
+{
+    memcpy(answer_alloc_msg(answer, buf_size), buf, buf_size);
 }
 
 
 int send_answer_to_client(answer_t * answer)
 {
+    unsigned long size = sizeof(unsigned int);
+
     /* If the answer is empty, there is nothing to send */
     if(!answer){
         return 0;
     }
     
-    /* we send a first message with the size of the answer */
-    if(write_to_client(answer->key, sizeof(unsigned int), &answer->nb_items)){
-        fprintf(stderr,"Error -- could not send message size to client %lu\n", answer->key);
+    /* the first message is the nb of msgs of the answer */
+    memcpy(answer->buf, &size, sizeof(unsigned long));
+    memcpy(answer->buf + sizeof(unsigned long), &answer->nb_items, sizeof(unsigned int));
+
+    /* the whole answer is sent at once */
+    BABBLE_PROBE2(answer__send, answer->key, answer->size);
+    if(write_raw_to_client(answer->key, answer->size, answer->buf)){
+        log_error("could not send answer to client %lu", answer->key);
+        BABBLE_PROBE2(answer__sent, answer->key, -1);
         return -1;
     }
-
-    /* we iterate over the messages and send them on by one */
-    answer_msg_t *iter = answer->first;
-    
-    while(iter != NULL ){
-        if(write_to_client(answer->key, iter->size, iter->buf)){
-
-            fprintf(stderr,"Error -- could not send a msg to client %lu\n", answer->key);
-            return -1;
-        }
-        iter = iter->next;
-    }
+    BABBLE_PROBE2(answer__sent, answer->key, 0);
 
     return 0;
 }
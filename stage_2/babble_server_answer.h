@@ -1,28 +1,41 @@
 #ifndef __BABBLE_SERVER_ANSWER_H__
 #define __BABBLE_SERVER_ANSWER_H__
 
+#include <stddef.h>
 
-/* an answer msg */
-typedef struct answer_msg{
-    void *buf; /* the data to send */
-    size_t size; /* the size of buf in bytes */
-    struct answer_msg *next; /* Since a request can require multiple msgs
-                          * in the answer (eg, answer to a timeline
-                          * msg), we add the possibility to chain
-                          * answers in a list */
-} answer_msg_t;
-
-/* a answer to one client command; it can include a list of answer_msg */
+#include "babble_config.h"
+
+/* a answer to one client command; it can include several msgs */
+/* the msgs are stored in an arena, already laid out as they are sent
+ * on the wire: a header made of the nb of msgs (filled when the answer
+ * is sent), followed by each msg preceded by its size. The arena starts
+ * in the inline buffer of the answer, and moves to the heap if it grows
+ * beyond BABBLE_ANSWER_ARENA_SIZE bytes */
 typedef struct answer{
     unsigned long key; /* key of the target client */
     unsigned int nb_items; /* nb of msgs in the answer */
-    answer_msg_t *first; /* first msg in the answer */
+    char *buf; /* the arena */
+    size_t size; /* bytes used in buf */
+    size_t last_msg; /* offset of the size of the last msg */
+    size_t capacity; /* size of buf */
+    char inline_buf[BABBLE_ANSWER_ARENA_SIZE];
 } answer_t;
 
+/* has to be called once before answers are allocated */
+void answer_init(void);
+
 answer_t* alloc_answer(unsigned long key);
 void free_answer(answer_t *answer);
 void add_msg_to_answer(answer_t *answer, size_t buf_size, void *buf);
 
+/* appends a msg of buf_size bytes to the answer, and returns the
+ * location where its content has to be written */
+void *answer_alloc_msg(answer_t *answer, size_t buf_size);
+
+/* shrinks the last msg of the answer to its first buf_size bytes, for
+ * msgs whose length is only known once they are written */
+void answer_trim_msg(answer_t *answer, size_t buf_size);
+
 /* the answer is self-contained, it includes all information necessary
  * to send the data to the client */
 int send_answer_to_client(answer_t * answer);
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 
 #include "babble_server.h"
@@ -15,9 +16,36 @@
 #include "babble_communication.h"
 #include "babble_registration.h"
 #include "babble_timeline.h"
+#include "babble_fanout.h"
+#include "babble_slab.h"
+#include "babble_format.h"
+#include "babble_log.h"
+#include "babble_stats.h"
+#include "babble_trace.h"
+#include "babble_profiler.h"
+#include "babble_memory.h"
+#include "babble_topk.h"
 
 time_t server_start;
 
+fanout_mode_t fanout_mode = FANOUT_PUSH;
+
+unsigned int hybrid_threshold = BABBLE_HYBRID_THRESHOLD;
+
+/* caches of the objects allocated on each command and login */
+static slab_cache_t command_cache;
+static slab_cache_t client_cache;
+
+/* threshold currently applied, adapted from hybrid_threshold */
+static unsigned int hybrid_current_threshold = BABBLE_HYBRID_THRESHOLD;
+
+/* nb of PUBLISH and TIMELINE since the last threshold update */
+static unsigned long hybrid_nb_publish = 0;
+static unsigned long hybrid_nb_timeline = 0;
+
+/* date of the last threshold update, in ms */
+static long hybrid_last_update = 0;
+
 /* freeing client_bundle_t struct */
 static void free_client_data(client_bundle_t *client)
 {
@@ -25,48 +53,72 @@ static void free_client_data(client_bundle_t *client)
     {
         return;
     }
-    pthread_mutex_destroy(&client->flock);
-    pthread_mutex_destroy(&client->cmdlock);
-    sem_destroy(&client->cmd_sem);
+    babble_mutex_destroy(&client->following_lock);
+    babble_mutex_destroy(&client->cmdlock);
+    pthread_cond_destroy(&client->cmd_cond);
 
     /* IMPORTANT: we choose not to free client_bundle_t structures when
      * a client disconnects. The reason is that pointers to this data
      * structure are stored in several places in the code, and so,
-     * freeing properly would be a complex operation */
+     * freeing properly would be a complex operation. For the same
+     * reason, the sets of followers/followed clients and the outbox
+     * are kept */
 
     /* free(client);*/
 }
 
+/* counts the commands of client being processed, RDV waits for them */
+static void client_cmd_begin(client_bundle_t *client)
+{
+    babble_mutex_lock(&client->cmdlock);
+    client->cmd_on_wait++;
+    babble_mutex_unlock(&client->cmdlock);
+}
+
+static void client_cmd_end(client_bundle_t *client)
+{
+    babble_mutex_lock(&client->cmdlock);
+    client->cmd_on_wait--;
+    if (client->cmd_on_wait == 0)
+    {
+        pthread_cond_broadcast(&client->cmd_cond); // all commands are done
+    }
+    babble_mutex_unlock(&client->cmdlock);
+}
+
 /* stores an error message in the answer_set of a command */
 static void generate_cmd_error(command_t *cmd, answer_t **answer)
 {
     answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+    fmt_buf_t reply;
 
     /* lookup client */
     client_bundle_t *client = registration_lookup(cmd->key);
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- no client found\n");
+        log_error("no client found");
         return;
     }
 
     the_answer = alloc_answer(client->key);
 
-    msg_buffer = malloc(BABBLE_BUFFER_SIZE);
+    fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+    fmt_reply_header(&reply, client, time(NULL) - server_start);
+    fmt_lit(&reply, "ERROR -> ");
+    fmt_long(&reply, cmd->cid);
 
     if (cmd->cid == LOGIN || cmd->cid == PUBLISH || cmd->cid == FOLLOW)
     {
-        snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: ERROR -> %d { %s } \n", client->client_name, time(NULL) - server_start, cmd->cid, cmd->msg);
+        fmt_lit(&reply, " { ");
+        fmt_mem(&reply, cmd->msg, strnlen(cmd->msg, BABBLE_PUBLICATION_SIZE));
+        fmt_lit(&reply, " } \n");
     }
     else
     {
-        snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: ERROR -> %d \n", client->client_name, time(NULL) - server_start, cmd->cid);
+        fmt_lit(&reply, " \n");
     }
-
-    add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
-    free(msg_buffer);
+    fmt_end(&reply);
 
     *answer = the_answer;
 }
@@ -94,18 +146,97 @@ void display_command(command_t *cmd, FILE *stream)
     case RDV:
         fprintf(stream, "RDV\n");
         break;
+    case STATS:
+        fprintf(stream, "STATS: %s\n", cmd->msg);
+        break;
     default:
         fprintf(stream, "Error -- Unknown command id\n");
         return;
     }
 }
 
+/* monotonic date in ms */
+static long now_ms(void)
+{
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+
+    return tt.tv_sec * 1000 + tt.tv_nsec / 1000000;
+}
+
+/* adapts the hybrid threshold to the measured rates: pulling a client
+ * costs one outbox lookup per TIMELINE of each of its followers, while
+ * pushing costs one timeline insert per PUBLISH and per follower. The
+ * more TIMELINE per PUBLISH, the fewer clients should be pulled. */
+static void hybrid_update_threshold(void)
+{
+    long now = now_ms();
+    long last = hybrid_last_update;
+
+    if (now - last < BABBLE_HYBRID_PERIOD)
+    {
+        return;
+    }
+
+    /* a single thread updates the threshold for a given period */
+    if (!__sync_bool_compare_and_swap(&hybrid_last_update, last, now))
+    {
+        return;
+    }
+
+    unsigned long nb_publish = __atomic_exchange_n(&hybrid_nb_publish, 0, __ATOMIC_RELAXED);
+    unsigned long nb_timeline = __atomic_exchange_n(&hybrid_nb_timeline, 0, __ATOMIC_RELAXED);
+
+    if (nb_publish == 0)
+    {
+        return;
+    }
+
+    /* the configured threshold corresponds to one TIMELINE per PUBLISH */
+    unsigned long target = (unsigned long)hybrid_threshold * nb_timeline / nb_publish;
+
+    if (target < BABBLE_HYBRID_THRESHOLD_MIN)
+    {
+        target = BABBLE_HYBRID_THRESHOLD_MIN;
+    }
+    if (target > BABBLE_HYBRID_THRESHOLD_MAX)
+    {
+        target = BABBLE_HYBRID_THRESHOLD_MAX;
+    }
+
+    /* smooth the variations between periods */
+    hybrid_current_threshold = (hybrid_current_threshold * 3 + target) / 4;
+}
+
+/* in hybrid mode, tells if the publications of client have to be
+ * pulled by its followers */
+static int hybrid_is_pulled(client_bundle_t *client)
+{
+    __sync_fetch_and_add(&hybrid_nb_publish, 1);
+    hybrid_update_threshold();
+
+    return follower_set_size(&client->followers) > hybrid_current_threshold;
+}
+
 /* initialize the server */
 void server_data_init(void)
 {
     server_start = time(NULL);
+    log_init();
+
+    hybrid_current_threshold = hybrid_threshold;
+    hybrid_last_update = now_ms();
+
+    slab_cache_init(&command_cache, "command", sizeof(command_t), __alignof__(command_t));
+    slab_cache_init(&client_cache, "client_bundle", sizeof(client_bundle_t), __alignof__(client_bundle_t));
+    timeline_init();
+    answer_init();
+    stats_init();
+    mem_init();
 
     registration_init();
+
+    fanout_init();
 }
 
 /* open a socket to receive client connections */
@@ -158,6 +289,7 @@ int server_connection_accept(int sock)
     int new_sock;
     struct sockaddr_in cli_addr;
     socklen_t clilen = sizeof(cli_addr);
+    int one = 1;
 
     new_sock = accept(sock, (struct sockaddr *)&cli_addr, &clilen);
 
@@ -168,23 +300,35 @@ int server_connection_accept(int sock)
         return -1;
     }
 
+    /* the answers are small and written at once: with Nagle's
+     * algorithm, an answer sent before the client acknowledged the
+     * previous one would wait for that ACK, which the client delays */
+    setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
     return new_sock;
 }
 
 /* create a new command for client corresponding to key */
 command_t *new_command(unsigned long key)
 {
-    command_t *cmd = malloc(sizeof(command_t));
+    command_t *cmd = slab_alloc(&command_cache);
+    mem_account_alloc(MEM_COMMANDS, sizeof(command_t));
     cmd->key = key;
     cmd->answer_expected = 0;
 
     return cmd;
 }
 
+void free_command(command_t *cmd)
+{
+    slab_free(&command_cache, cmd);
+    mem_account_free(MEM_COMMANDS, sizeof(command_t));
+}
+
 int run_login_command(command_t *cmd, answer_t **answer)
 {
     answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+    fmt_buf_t reply;
 
     struct timespec tt;
     clock_gettime(CLOCK_REALTIME, &tt);
@@ -192,128 +336,187 @@ int run_login_command(command_t *cmd, answer_t **answer)
     /* compute hash of the new client id */
     cmd->key = hash(cmd->msg);
 
-    client_bundle_t *client_data = malloc(sizeof(client_bundle_t));
+    client_bundle_t *client_data = slab_alloc(&client_cache);
+    mem_account_alloc(MEM_REGISTRATION, sizeof(client_bundle_t));
 
-    sem_init(&client_data->cmd_sem, 0, 0);
-    pthread_mutex_init(&client_data->cmdlock, NULL);
+    pthread_cond_init(&client_data->cmd_cond, NULL);
+    babble_mutex_init(&client_data->cmdlock, LOCK_CMD);
     client_data->cmd_on_wait = 0;
 
     strncpy(client_data->client_name, cmd->msg, BABBLE_ID_SIZE);
+    format_client_prefix(client_data);
+    babble_mutex_set_label(&client_data->cmdlock, client_data->client_name);
     client_data->sock = cmd->sock;
     client_data->key = cmd->key;
 
     client_data->timeline = timeline_create(client_data->key);
+    client_data->outbox = timeline_create(client_data->key);
+
+    /* the followers set has to be ready before the client becomes
+     * visible to others through the registration table */
+    babble_mutex_init(&client_data->following_lock, LOCK_FOLLOWING);
+    babble_mutex_set_label(&client_data->following_lock, client_data->client_name);
+    follower_set_init(&client_data->followers);
+    follower_set_init(&client_data->following);
 
     /* we follow ourself */
-    client_data->followers[0] = client_data;
-    client_data->nb_followers = 1;
+    follower_set_add(&client_data->followers, client_data);
+    follower_set_add(&client_data->following, client_data);
+
+    client_data->disconnected = 0;
 
     if (registration_insert(client_data))
     {
         timeline_free(client_data->timeline);
-        free(client_data);
+        timeline_free(client_data->outbox);
+        follower_set_destroy(&client_data->followers);
+        follower_set_destroy(&client_data->following);
+        babble_mutex_destroy(&client_data->following_lock);
+        slab_free(&client_cache, client_data);
+        mem_account_free(MEM_REGISTRATION, sizeof(client_bundle_t));
         generate_cmd_error(cmd, answer);
         return -1;
     }
 
-    client_data->disconnected = 0;
-
-    pthread_mutex_init(&client_data->flock, NULL); // TO INIT MUTEX
-
-    printf("### New client %s (key = %lu)\n", client_data->client_name, client_data->key);
+    log_info("### New client %s (key = %lu)", client_data->client_name, client_data->key);
 
     /* answer to client */
     assert(cmd->answer_expected);
 
     the_answer = alloc_answer(client_data->key);
-    msg_buffer = malloc(BABBLE_BUFFER_SIZE);
-
-    snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: registered with key %lu\n", client_data->client_name, tt.tv_sec - server_start, client_data->key);
-
-    add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
-    free(msg_buffer);
+    fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+    fmt_reply_header(&reply, client_data, tt.tv_sec - server_start);
+    fmt_lit(&reply, "registered with key ");
+    fmt_ulong(&reply, client_data->key);
+    fmt_lit(&reply, "\n");
+    fmt_end(&reply);
 
     *answer = the_answer;
 
     return 0;
 }
 
-int run_publish_command(command_t *cmd, answer_t **answer)
+/* called by the fan-out once a streamed publication reached all the
+ * timelines */
+static void publish_done(void *arg)
 {
-    time_t date = 0;
-    client_bundle_t *client = registration_lookup(cmd->key);
-    int i = 0;
+    client_cmd_end((client_bundle_t *)arg);
+}
 
-    answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+/* inserts pub in the timeline of each follower of client (push mode) */
+/* large fan-outs are split among the fan-out workers; unless wait is
+ * set, the function may return before all timelines are updated */
+/* returns the nb of timelines pub is inserted in */
+static unsigned int push_to_followers(client_bundle_t *client, publication_t *pub, int wait)
+{
+    client_bundle_t *follower = NULL;
+    client_bundle_t **followers = NULL;
+    unsigned int nb_followers = 0;
+    unsigned int max_followers = follower_set_size(&client->followers);
+    follower_iter_t iter;
 
-    int client_disconnected = 0;
+    /* the set is traversed without lock: concurrent FOLLOWs are not
+     * blocked, and may or may not be visible */
+    follower_set_iter_init(&client->followers, &iter);
 
-    if (client == NULL)
+    if (max_followers > BABBLE_FANOUT_CHUNK)
     {
-        fprintf(stderr, "Error -- no client found\n");
-        generate_cmd_error(cmd, answer);
-        return -1;
+        /* large fan-out: take a snapshot of the followers so that the
+         * timelines can be updated by the fan-out workers */
+        followers = malloc(max_followers * sizeof(client_bundle_t *));
     }
 
-    // increment counter
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait++;
-    pthread_mutex_unlock(&client->cmdlock);
-    sem_post(&client->cmd_sem);
-
-    for (i = 0; i < client->nb_followers; i++)
+    /* disconnected clients are removed from the sets of followers by
+     * unregisted_client() */
+    while ((follower = follower_set_next(&iter)) != NULL)
     {
-        if (!client->followers[i]->disconnected)
+        if (followers != NULL)
         {
-            date = timeline_insert(client->followers[i]->timeline, client, cmd->msg);
+            if (nb_followers == max_followers)
+            {
+                /* followers added during the traversal */
+                max_followers *= 2;
+                followers = realloc(followers, max_followers * sizeof(client_bundle_t *));
+            }
+            followers[nb_followers++] = follower;
         }
         else
         {
-            client_disconnected = 1;
+            timeline_insert(follower->timeline, pub);
+            nb_followers++;
         }
     }
+    follower_set_iter_end(&iter);
 
-    /* removing disconnected clients from the list of followers */
-    if (client_disconnected)
+    if (followers != NULL)
     {
-        for (i = 0; i < client->nb_followers; i++)
+        if (wait)
         {
-            if (client->followers[i]->disconnected)
-            {
-                /* remove the client from the set of followers */
-                printf("### Client %s removed disconnected client %s from its list of followers\n", client->client_name, client->followers[i]->client_name);
-                client->followers[i] = client->followers[client->nb_followers - 1];
-                client->nb_followers--;
-                /* decrease the index to go through the follower we moved
-                   in the array */
-                i--;
-            }
+            fanout_publish(pub, followers, nb_followers, 1, NULL, NULL);
+        }
+        else
+        {
+            /* RDV has to wait for the end of the fan-out */
+            client_cmd_begin(client);
+            fanout_publish(pub, followers, nb_followers, 0, publish_done, client);
         }
     }
 
-    // printf("### Client %s published { %s } at date %ld\n", client->client_name, cmd->msg, date);
+    return nb_followers;
+}
 
-    if (cmd->answer_expected)
+int run_publish_command(command_t *cmd, answer_t **answer)
+{
+    time_t date = 0;
+    client_bundle_t *client = registration_lookup(cmd->key);
+
+    answer_t *the_answer = NULL;
+    fmt_buf_t reply;
+
+    if (client == NULL)
     {
-        the_answer = alloc_answer(client->key);
-        msg_buffer = malloc(BABBLE_BUFFER_SIZE);
+        log_error("no client found");
+        generate_cmd_error(cmd, answer);
+        return -1;
+    }
 
-        snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: { %s }\n", client->client_name, date, cmd->msg);
+    // increment counter
+    client_cmd_begin(client);
 
-        add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
-        free(msg_buffer);
+    /* the publication is formatted once and shared by all timelines */
+    publication_t *pub = publication_create(client, cmd->msg);
+    date = pub->date;
+
+    if (fanout_mode == FANOUT_PULL || (fanout_mode == FANOUT_HYBRID && hybrid_is_pulled(client)))
+    {
+        /* readers will fetch it from our outbox */
+        timeline_insert(client->outbox, pub);
+        topk_record(TOPK_FANOUT_EDGES, client->key, 1);
+    }
+    else
+    {
+        /* when streaming, no need to wait for the whole fan-out */
+        topk_record(TOPK_FANOUT_EDGES, client->key, push_to_followers(client, pub, cmd->answer_expected));
     }
 
-    *answer = the_answer;
+    publication_put(pub);
 
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait--;
-    if (client->cmd_on_wait == 0)
+    // printf("### Client %s published { %s } at date %ld\n", client->client_name, cmd->msg, date);
+
+    if (cmd->answer_expected)
     {
-        sem_post(&client->cmd_sem); // all commands are done
+        the_answer = alloc_answer(client->key);
+        fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+        fmt_reply_header(&reply, client, date);
+        fmt_lit(&reply, "{ ");
+        fmt_mem(&reply, cmd->msg, strnlen(cmd->msg, BABBLE_PUBLICATION_SIZE));
+        fmt_lit(&reply, " }\n");
+        fmt_end(&reply);
     }
-    pthread_mutex_unlock(&client->cmdlock);
+
+    *answer = the_answer;
+
+    client_cmd_end(client);
 
     return 0;
 }
@@ -321,22 +524,19 @@ int run_publish_command(command_t *cmd, answer_t **answer)
 int run_follow_command(command_t *cmd, answer_t **answer)
 {
     answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+    fmt_buf_t reply;
 
     client_bundle_t *client = registration_lookup(cmd->key);
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- no client found\n");
+        log_error("no client found");
         generate_cmd_error(cmd, answer);
         return -1;
     }
 
     // increment counter
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait++;
-    pthread_mutex_unlock(&client->cmdlock);
-    sem_post(&client->cmd_sem);
+    client_cmd_begin(client);
 
     /* compute hash of the client to follow */
     unsigned long f_key = hash(cmd->msg);
@@ -347,32 +547,36 @@ int run_follow_command(command_t *cmd, answer_t **answer)
     if (f_client == NULL)
     {
         generate_cmd_error(cmd, answer);
+        client_cmd_end(client);
         return 0;
     }
 
-    pthread_mutex_lock(&f_client->flock); // to lock followers list
+    /* if client is not already followed, add it (lock-free, so that
+     * many clients can start following the same one concurrently) */
+    int already_follows = follower_set_add(&f_client->followers, client);
 
-    /* if client is not already followed, add it */
-    int i = 0;
-    for (i = 0; i < f_client->nb_followers; i++)
+    if (already_follows)
     {
-        if (f_client->followers[i]->key == client->key)
-        {
-            break;
-        }
-    }
-
-    if (i == f_client->nb_followers)
-    {
-        f_client->followers[i] = client;
-        f_client->nb_followers++;
+        log_warning("%s already follows %s", client->client_name, f_client->client_name);
     }
     else
     {
-        printf("Warning: %s already follows %s\n", client->client_name, f_client->client_name);
-    }
+        /* only the publications made from now on will be pulled */
+        babble_mutex_lock(&client->following_lock);
+        if (!follower_set_add(&client->following, f_client))
+        {
+            follower_set_find(&client->following, f_client)->cursor = timeline_nb_inserts(f_client->outbox);
+        }
 
-    pthread_mutex_unlock(&f_client->flock);
+        /* client may have been unregistered while following f_client:
+         * unregisted_client() did not see f_client in its following
+         * set, so the follower edge is removed here */
+        if (client->disconnected)
+        {
+            follower_set_remove(&f_client->followers, client);
+        }
+        babble_mutex_unlock(&client->following_lock);
+    }
 
     /* generate answer to client */
     if (cmd->answer_expected)
@@ -380,26 +584,51 @@ int run_follow_command(command_t *cmd, answer_t **answer)
 
         the_answer = alloc_answer(client->key);
 
-        msg_buffer = malloc(BABBLE_BUFFER_SIZE);
+        fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+        fmt_reply_header(&reply, client, time(NULL) - server_start);
+        fmt_lit(&reply, "follow ");
+        fmt_mem(&reply, f_client->client_name, strnlen(f_client->client_name, BABBLE_ID_SIZE));
+        fmt_lit(&reply, "\n");
+        fmt_end(&reply);
+    }
+
+    *answer = the_answer;
+
+    client_cmd_end(client);
 
-        snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: follow %s\n", client->client_name, time(NULL) - server_start, f_client->client_name);
+    return 0;
+}
 
-        add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
+/* builds the timeline of client by merging the outboxes of the
+ * clients it follows (pull mode), and the publications pushed to its
+ * timeline (hybrid mode) */
+static void pull_timeline(client_bundle_t *client, answer_t **answer)
+{
+    timeline_selection_t sel;
+    follower_entry_t *followed = NULL;
+    follower_iter_t iter;
 
-        free(msg_buffer);
+    timeline_selection_init(&sel);
+
+    if (fanout_mode == FANOUT_HYBRID)
+    {
+        __sync_fetch_and_add(&hybrid_nb_timeline, 1);
+        timeline_take_recent(client->timeline, &sel);
     }
 
-    *answer = the_answer;
+    /* the lock protects the cursors */
+    babble_mutex_lock(&client->following_lock);
 
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait--;
-    if (client->cmd_on_wait == 0)
+    follower_set_iter_init(&client->following, &iter);
+    while ((followed = follower_set_next_entry(&iter)) != NULL)
     {
-        sem_post(&client->cmd_sem); // all commands are done
+        timeline_pull(followed->client->outbox, &followed->cursor, &sel);
     }
-    pthread_mutex_unlock(&client->cmdlock);
+    follower_set_iter_end(&iter);
 
-    return 0;
+    babble_mutex_unlock(&client->following_lock);
+
+    timeline_selection_generate_summary(&sel, client->key, answer);
 }
 
 int run_timeline_command(command_t *cmd, answer_t **answer)
@@ -409,26 +638,24 @@ int run_timeline_command(command_t *cmd, answer_t **answer)
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- no client found\n");
+        log_error("no client found");
         generate_cmd_error(cmd, answer);
         return -1;
     }
 
     // increment counter
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait++;
-    pthread_mutex_unlock(&client->cmdlock);
-    sem_post(&client->cmd_sem);
-
-    timeline_generate_summary(client->timeline, answer);
+    client_cmd_begin(client);
 
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait--;
-    if (client->cmd_on_wait == 0)
+    if (fanout_mode == FANOUT_PUSH)
+    {
+        timeline_generate_summary(client->timeline, answer);
+    }
+    else
     {
-        sem_post(&client->cmd_sem); // all commands are done
+        pull_timeline(client, answer);
     }
-    pthread_mutex_unlock(&client->cmdlock);
+
+    client_cmd_end(client);
 
     return 0;
 }
@@ -436,44 +663,34 @@ int run_timeline_command(command_t *cmd, answer_t **answer)
 int run_fcount_command(command_t *cmd, answer_t **answer)
 {
     answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+    fmt_buf_t reply;
 
     /* lookup client */
     client_bundle_t *client = registration_lookup(cmd->key);
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- no client found\n");
+        log_error("no client found");
         generate_cmd_error(cmd, answer);
         return -1;
     }
 
     // increment counter
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait++;
-    pthread_mutex_unlock(&client->cmdlock);
-    sem_post(&client->cmd_sem);
+    client_cmd_begin(client);
 
     /* generate answer to client */
     the_answer = alloc_answer(client->key);
 
-    msg_buffer = malloc(BABBLE_BUFFER_SIZE);
-
-    snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: has %d followers\n", client->client_name, time(NULL) - server_start, client->nb_followers);
-
-    add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
-
-    free(msg_buffer);
+    fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+    fmt_reply_header(&reply, client, time(NULL) - server_start);
+    fmt_lit(&reply, "has ");
+    fmt_long(&reply, (int)follower_set_size(&client->followers));
+    fmt_lit(&reply, " followers\n");
+    fmt_end(&reply);
 
     *answer = the_answer;
 
-    pthread_mutex_lock(&client->cmdlock);
-    client->cmd_on_wait--;
-    if (client->cmd_on_wait == 0)
-    {
-        sem_post(&client->cmd_sem); // all commands are done
-    }
-    pthread_mutex_unlock(&client->cmdlock);
+    client_cmd_end(client);
 
     return 0;
 }
@@ -481,42 +698,117 @@ int run_fcount_command(command_t *cmd, answer_t **answer)
 int run_rdv_command(command_t *cmd, answer_t **answer)
 {
     answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+    fmt_buf_t reply;
 
     /* lookup client */
     client_bundle_t *client = registration_lookup(cmd->key);
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- no client found\n");
+        log_error("no client found");
         generate_cmd_error(cmd, answer);
         return -1;
     }
 
     // to wait for cmds on wait to finish
-    pthread_mutex_lock(&client->cmdlock);
+    babble_mutex_lock(&client->cmdlock);
     while (client->cmd_on_wait > 0)
     {
-        sem_wait(&client->cmd_sem);
+        babble_cond_wait(&client->cmd_cond, &client->cmdlock);
     }
-    pthread_mutex_unlock(&client->cmdlock);
+    babble_mutex_unlock(&client->cmdlock);
 
     /* generate answer to client */
     the_answer = alloc_answer(client->key);
 
-    msg_buffer = malloc(BABBLE_BUFFER_SIZE);
+    fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+    fmt_reply_header(&reply, client, time(NULL) - server_start);
+    fmt_lit(&reply, "rdv_ack\n");
+    fmt_end(&reply);
 
-    snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: rdv_ack\n", client->client_name, time(NULL) - server_start);
+    *answer = the_answer;
 
-    add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
+    return 0;
+}
 
-    free(msg_buffer);
+int run_stats_command(command_t *cmd, answer_t **answer)
+{
+    answer_t *the_answer = NULL;
+    fmt_buf_t reply;
+
+    /* lookup client */
+    client_bundle_t *client = registration_lookup(cmd->key);
+
+    if (client == NULL)
+    {
+        log_error("no client found");
+        generate_cmd_error(cmd, answer);
+        return -1;
+    }
+
+    the_answer = alloc_answer(client->key);
+
+    fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_STATS_REPLY_SIZE), BABBLE_STATS_REPLY_SIZE);
+    fmt_reply_header(&reply, client, time(NULL) - server_start);
+
+    if (!strcmp(cmd->msg, "RESET"))
+    {
+        stats_reset();
+        lock_reset();
+        mem_reset();
+        topk_reset();
+        fmt_lit(&reply, "stats reset\n");
+    }
+    else if (!strcmp(cmd->msg, "LOCKS"))
+    {
+        lock_format_report(&reply);
+    }
+    else if (!strcmp(cmd->msg, "PROFILE"))
+    {
+        profiler_format_dump(&reply);
+    }
+    else if (!strcmp(cmd->msg, "MEMORY"))
+    {
+        mem_format_report(&reply);
+    }
+    else if (!strcmp(cmd->msg, "TOP"))
+    {
+        topk_format_report(&reply);
+    }
+    else
+    {
+        stats_format_commands(&reply);
+    }
+
+    /* only the report and its terminating '\0' are sent */
+    answer_trim_msg(the_answer, fmt_end(&reply) + 1);
 
     *answer = the_answer;
 
     return 0;
 }
 
+/* removes client from the set of followers of each client it follows,
+ * so that publishers never visit disconnected clients */
+static void remove_from_followees(client_bundle_t *client)
+{
+    client_bundle_t *followed = NULL;
+    follower_iter_t iter;
+
+    /* the lock orders this cleanup with a concurrent FOLLOW of client
+     * (see run_follow_command()) */
+    babble_mutex_lock(&client->following_lock);
+
+    follower_set_iter_init(&client->following, &iter);
+    while ((followed = follower_set_next(&iter)) != NULL)
+    {
+        follower_set_remove(&followed->followers, client);
+    }
+    follower_set_iter_end(&iter);
+
+    babble_mutex_unlock(&client->following_lock);
+}
+
 int unregisted_client(command_t *cmd)
 {
     assert(cmd->cid == UNREGISTER);
@@ -526,10 +818,12 @@ int unregisted_client(command_t *cmd)
 
     if (client != NULL)
     {
-        printf("### Unregister client %s (key = %lu)\n", client->client_name, client->key);
+        log_info("### Unregister client %s (key = %lu)", client->client_name, client->key);
         close(client->sock);
         client->disconnected = 1;
 
+        remove_from_followees(client);
+
         free_client_data(client);
     }
 
@@ -540,14 +834,14 @@ int unregisted_client(command_t *cmd)
 int notify_parse_error(command_t *cmd, char *input, answer_t **answer)
 {
     answer_t *the_answer = NULL;
-    char *msg_buffer = NULL;
+    fmt_buf_t reply;
 
     /* lookup client */
     client_bundle_t *client = registration_lookup(cmd->key);
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- no client found\n");
+        log_error("no client found");
         return -1;
     }
 
@@ -555,13 +849,12 @@ int notify_parse_error(command_t *cmd, char *input, answer_t **answer)
     {
         the_answer = alloc_answer(client->key);
 
-        msg_buffer = malloc(BABBLE_BUFFER_SIZE);
-
-        snprintf(msg_buffer, BABBLE_BUFFER_SIZE, "%s[%ld]: ERROR -> %s\n", client->client_name, time(NULL) - server_start, input);
-
-        add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, msg_buffer);
-
-        free(msg_buffer);
+        fmt_init(&reply, answer_alloc_msg(the_answer, BABBLE_BUFFER_SIZE), BABBLE_BUFFER_SIZE);
+        fmt_reply_header(&reply, client, time(NULL) - server_start);
+        fmt_lit(&reply, "ERROR -> ");
+        fmt_str(&reply, input);
+        fmt_lit(&reply, "\n");
+        fmt_end(&reply);
     }
 
     *answer = the_answer;
@@ -576,7 +869,7 @@ int write_to_client(unsigned long key, int size, void *buf)
 
     if (client == NULL)
     {
-        fprintf(stderr, "Error -- writing to non existing client %lu\n", key);
+        log_error("writing to non existing client %lu", key);
         return -1;
     }
 
@@ -591,6 +884,28 @@ int write_to_client(unsigned long key, int size, void *buf)
     return 0;
 }
 
+int write_raw_to_client(unsigned long key, unsigned long size, void *buf)
+{
+    client_bundle_t *client = registration_lookup(key);
+
+    if (client == NULL)
+    {
+        log_error("writing to non existing client %lu", key);
+        return -1;
+    }
+
+    uint64_t start = trace_begin();
+
+    if (network_send_raw(client->sock, size, buf) < 0)
+    {
+        perror("writing to socket");
+        return -1;
+    }
+    trace_span(TRACE_SOCKET_WRITE, start, key, size);
+
+    return 0;
+}
+
 char *get_name_from_key(unsigned long key)
 {
     char *name = (char *)malloc(BABBLE_ID_SIZE);
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "babble_slab.h"
+
+#ifdef BABBLE_USE_SLAB
+
+/* magazines of a thread for one cache: allocations and frees go to
+ * loaded, previous is a second magazine that avoids going to the
+ * depot when a thread alternates allocations and frees around a
+ * magazine boundary */
+typedef struct slab_local{
+    slab_magazine_t *loaded;
+    slab_magazine_t *previous;
+} slab_local_t;
+
+static __thread slab_local_t slab_locals[BABBLE_SLAB_MAX_CACHES];
+static __thread int slab_thread_registered = 0;
+
+static slab_cache_t *slab_caches[BABBLE_SLAB_MAX_CACHES];
+static int slab_nb_caches = 0;
+
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+/* gives a magazine back to the depot; called with the depot lock */
+static void depot_put(slab_cache_t *cache, slab_magazine_t *mag)
+{
+    if (mag->nb_objs > 0)
+    {
+        mag->next = cache->full;
+        cache->full = mag;
+    }
+    else
+    {
+        mag->next = cache->empty;
+        cache->empty = mag;
+    }
+}
+
+/* returns the magazines of an exiting thread to the depots, so that
+ * the objects they hold are not lost */
+static void slab_thread_exit(void *arg)
+{
+    slab_local_t *locals = arg;
+    int i = 0;
+
+    for (i = 0; i < slab_nb_caches; i++)
+    {
+        babble_mutex_lock(&slab_caches[i]->lock);
+        if (locals[i].loaded != NULL)
+        {
+            depot_put(slab_caches[i], locals[i].loaded);
+        }
+        if (locals[i].previous != NULL)
+        {
+            depot_put(slab_caches[i], locals[i].previous);
+        }
+        babble_mutex_unlock(&slab_caches[i]->lock);
+
+        locals[i].loaded = NULL;
+        locals[i].previous = NULL;
+    }
+}
+
+static void slab_key_create(void)
+{
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+static slab_local_t *slab_local(slab_cache_t *cache)
+{
+    if (!slab_thread_registered)
+    {
+        pthread_setspecific(slab_key, slab_locals);
+        slab_thread_registered = 1;
+    }
+    return &slab_locals[cache->id];
+}
+
+static void *slab_map(void)
+{
+    void *slab = MAP_FAILED;
+
+#if BABBLE_SLAB_HUGEPAGES && defined(MAP_HUGETLB)
+    slab = mmap(NULL, BABBLE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (slab == MAP_FAILED)
+    {
+        slab = mmap(NULL, BABBLE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+        {
+            perror("slab mmap");
+            exit(-1);
+        }
+#if BABBLE_SLAB_HUGEPAGES && defined(MADV_HUGEPAGE)
+        /* no reserved huge pages: ask for transparent ones */
+        madvise(slab, BABBLE_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+
+    return slab;
+}
+
+/* fills mag with new objects carved from the slabs; called with the
+ * depot lock */
+static void depot_carve(slab_cache_t *cache, slab_magazine_t *mag)
+{
+    while (mag->nb_objs < BABBLE_SLAB_MAGAZINE_SIZE)
+    {
+        if (cache->slab_cur + cache->obj_size > cache->slab_end)
+        {
+            cache->slab_cur = slab_map();
+            cache->slab_end = cache->slab_cur + BABBLE_SLAB_SIZE;
+            cache->nb_slabs++;
+        }
+        mag->objs[mag->nb_objs++] = cache->slab_cur;
+        cache->slab_cur += cache->obj_size;
+    }
+}
+
+static slab_magazine_t *magazine_new(void)
+{
+    slab_magazine_t *mag = malloc(sizeof(slab_magazine_t));
+
+    mag->nb_objs = 0;
+    mag->next = NULL;
+    return mag;
+}
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t obj_size, size_t align)
+{
+    pthread_once(&slab_key_once, slab_key_create);
+
+    if (slab_nb_caches == BABBLE_SLAB_MAX_CACHES)
+    {
+        fprintf(stderr, "Error -- too many slab caches (%s)\n", name);
+        exit(-1);
+    }
+
+    cache->name = name;
+    cache->align = (align < 16) ? 16 : align;
+    /* slabs are page-aligned: rounding the size keeps all objects
+     * aligned */
+    cache->obj_size = (obj_size + cache->align - 1) & ~(cache->align - 1);
+    cache->id = slab_nb_caches;
+    babble_mutex_init(&cache->lock, LOCK_SLAB);
+    babble_mutex_set_label(&cache->lock, name);
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->slab_cur = NULL;
+    cache->slab_end = NULL;
+    cache->nb_slabs = 0;
+
+    slab_caches[slab_nb_caches++] = cache;
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    slab_local_t *local = slab_local(cache);
+    slab_magazine_t *tmp = NULL;
+
+    if (local->loaded != NULL && local->loaded->nb_objs > 0)
+    {
+        return local->loaded->objs[--local->loaded->nb_objs];
+    }
+
+    if (local->previous != NULL && local->previous->nb_objs > 0)
+    {
+        tmp = local->loaded;
+        local->loaded = local->previous;
+        local->previous = tmp;
+        return local->loaded->objs[--local->loaded->nb_objs];
+    }
+
+    /* both magazines are empty: exchange one with a full magazine from
+     * the depot, or fill it from the slabs */
+    babble_mutex_lock(&cache->lock);
+
+    if (cache->full != NULL)
+    {
+        tmp = cache->full;
+        cache->full = tmp->next;
+        if (local->previous != NULL)
+        {
+            depot_put(cache, local->previous);
+        }
+        local->previous = local->loaded;
+        local->loaded = tmp;
+    }
+    else
+    {
+        if (local->loaded == NULL)
+        {
+            local->loaded = magazine_new();
+        }
+        depot_carve(cache, local->loaded);
+    }
+
+    babble_mutex_unlock(&cache->lock);
+
+    return local->loaded->objs[--local->loaded->nb_objs];
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    slab_local_t *local = slab_local(cache);
+    slab_magazine_t *tmp = NULL;
+
+    if (local->loaded != NULL && local->loaded->nb_objs < BABBLE_SLAB_MAGAZINE_SIZE)
+    {
+        local->loaded->objs[local->loaded->nb_objs++] = obj;
+        return;
+    }
+
+    if (local->previous != NULL && local->previous->nb_objs < BABBLE_SLAB_MAGAZINE_SIZE)
+    {
+        tmp = local->loaded;
+        local->loaded = local->previous;
+        local->previous = tmp;
+        local->loaded->objs[local->loaded->nb_objs++] = obj;
+        return;
+    }
+
+    /* both magazines are full: give one to the depot and take an
+     * empty one */
+    babble_mutex_lock(&cache->lock);
+
+    if (local->previous != NULL)
+    {
+        depot_put(cache, local->previous);
+    }
+    local->previous = local->loaded;
+
+    if (cache->empty != NULL)
+    {
+        local->loaded = cache->empty;
+        cache->empty = local->loaded->next;
+    }
+    else
+    {
+        local->loaded = NULL;
+    }
+
+    babble_mutex_unlock(&cache->lock);
+
+    if (local->loaded == NULL)
+    {
+        local->loaded = magazine_new();
+    }
+    local->loaded->objs[local->loaded->nb_objs++] = obj;
+}
+
+#else
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t obj_size, size_t align)
+{
+    memset(cache, 0, sizeof(slab_cache_t));
+    cache->name = name;
+    cache->obj_size = obj_size;
+    cache->align = (align < sizeof(void *)) ? sizeof(void *) : align;
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    void *obj = NULL;
+
+    if (cache->align <= 16)
+    {
+        return malloc(cache->obj_size);
+    }
+
+    if (posix_memalign(&obj, cache->align, cache->obj_size))
+    {
+        return NULL;
+    }
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    free(obj);
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __BABBLE_SLAB_H__
+#define __BABBLE_SLAB_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "babble_config.h"
+#include "babble_lock.h"
+
+/**** Object caches for fixed-size objects ****/
+
+/* with BABBLE_USE_SLAB, objects are carved from large slabs and
+ * recycled through per-thread magazines (stacks of free objects): a
+ * thread allocates from and frees to its own magazines without
+ * locking, and only goes to the depot of the cache to exchange a full
+ * magazine against an empty one (or the reverse). Objects are never
+ * given back to the system. Without BABBLE_USE_SLAB, the caches are
+ * plain wrappers around malloc()/free() */
+
+typedef struct slab_magazine{
+    unsigned int nb_objs;
+    void *objs[BABBLE_SLAB_MAGAZINE_SIZE];
+    struct slab_magazine *next;
+} slab_magazine_t;
+
+typedef struct slab_cache{
+    const char *name;
+    size_t obj_size;
+    size_t align;
+    int id; /* index of the magazines of the cache in each thread */
+
+    /* depot, protected by lock */
+    babble_mutex_t lock;
+    slab_magazine_t *full; /* magazines holding objects */
+    slab_magazine_t *empty;
+    char *slab_cur; /* free space in the current slab */
+    char *slab_end;
+    unsigned long nb_slabs;
+} slab_cache_t;
+
+/* has to be called before the cache is used by several threads; the
+ * objects are aligned on align bytes (at least 16, like malloc()) */
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t obj_size, size_t align);
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "babble_stats.h"
+
+/* the histograms of a shard: one per command type, one per stage,
+ * and the total duration of the queued commands */
+#define STATS_STAGES STATS_NB_COMMANDS
+#define STATS_TOTAL (STATS_STAGES + STATS_NB_STAGES)
+#define STATS_NB_HISTOGRAMS (STATS_TOTAL + 1)
+
+typedef struct stats_shard
+{
+    histogram_t histograms[STATS_NB_HISTOGRAMS];
+    uint64_t counters[STATS_NB_COUNTERS];
+} BABBLE_CACHELINE_ALIGNED stats_shard_t;
+
+static stats_shard_t *shards = NULL;
+static unsigned int next_shard = 0;
+static __thread stats_shard_t *my_shard = NULL;
+
+/* state at the last reset, protected by stats_lock; only reports and
+ * resets take the lock, never the recording threads */
+static babble_mutex_t stats_lock = BABBLE_MUTEX_INITIALIZER(LOCK_STATS);
+static histogram_t baseline[STATS_NB_HISTOGRAMS];
+static uint64_t baseline_date = 0;
+
+static const char *histogram_names[STATS_NB_HISTOGRAMS] = {
+    "LOGIN", "PUBLISH", "FOLLOW", "TIMELINE", "FOLLOW_COUNT", "RDV",
+    "recv", "queue", "service", "output", "total"};
+
+uint64_t stats_now(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return (uint64_t)tt.tv_sec * 1000000000ULL + tt.tv_nsec;
+}
+
+void stats_init(void)
+{
+    int i = 0;
+
+    if (posix_memalign((void **)&shards, BABBLE_CACHELINE_SIZE, BABBLE_STATS_SHARDS * sizeof(stats_shard_t)))
+    {
+        abort();
+    }
+    for (i = 0; i < BABBLE_STATS_SHARDS * STATS_NB_HISTOGRAMS; i++)
+    {
+        histogram_init(&shards[i / STATS_NB_HISTOGRAMS].histograms[i % STATS_NB_HISTOGRAMS]);
+    }
+    for (i = 0; i < STATS_NB_HISTOGRAMS; i++)
+    {
+        histogram_init(&baseline[i]);
+    }
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        memset(shards[i].counters, 0, sizeof(shards[i].counters));
+    }
+    baseline_date = stats_now();
+}
+
+static stats_shard_t *get_shard(void)
+{
+    if (my_shard == NULL)
+    {
+        my_shard = &shards[__sync_fetch_and_add(&next_shard, 1) % BABBLE_STATS_SHARDS];
+    }
+    return my_shard;
+}
+
+void stats_record_command(command_id cid, uint64_t ns)
+{
+    if (cid < STATS_NB_COMMANDS)
+    {
+        /* shards are only shared when there are more threads than
+         * shards, the atomic adds are then needed */
+        histogram_record_atomic(&get_shard()->histograms[cid], ns);
+    }
+}
+
+void stats_add(stats_counter_t counter, uint64_t v)
+{
+    __atomic_fetch_add(&get_shard()->counters[counter], v, __ATOMIC_RELAXED);
+}
+
+void stats_record_bytes(command_id cid, uint64_t bytes_in, uint64_t bytes_out)
+{
+    stats_shard_t *shard = get_shard();
+
+    if (cid < STATS_NB_COMMANDS)
+    {
+        __atomic_fetch_add(&shard->counters[STATS_BYTES_IN + cid], bytes_in, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shard->counters[STATS_BYTES_OUT + cid], bytes_out, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t stats_counter(stats_counter_t counter)
+{
+    uint64_t total = 0;
+    int i = 0;
+
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        total += __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+void stats_record_lifecycle(command_t *cmd)
+{
+    stats_shard_t *shard = get_shard();
+    int i = 0;
+
+    for (i = 0; i < STATS_NB_STAGES; i++)
+    {
+        histogram_record_atomic(&shard->histograms[STATS_STAGES + i], cmd->dates[i + 1] - cmd->dates[i]);
+    }
+    histogram_record_atomic(&shard->histograms[STATS_TOTAL], cmd->dates[STAMP_SENT] - cmd->dates[STAMP_RECV]);
+    __atomic_fetch_add(&shard->counters[STATS_EXECUTOR_BUSY], cmd->dates[STAMP_SENT] - cmd->dates[STAMP_DEQUEUE], __ATOMIC_RELAXED);
+}
+
+/* merges the shards of histogram index into h */
+static void merge_histogram(int index, histogram_t *h)
+{
+    int i = 0;
+
+    histogram_init(h);
+    for (i = 0; i < BABBLE_STATS_SHARDS; i++)
+    {
+        histogram_add(h, &shards[i].histograms[index]);
+    }
+}
+
+void stats_command_histogram(command_id cid, histogram_t *h)
+{
+    merge_histogram(cid, h);
+}
+
+void stats_stage_histogram(int stage, histogram_t *h)
+{
+    merge_histogram(STATS_STAGES + stage, h);
+}
+
+const char *stats_command_name(command_id cid)
+{
+    return histogram_names[cid];
+}
+
+const char *stats_stage_name(int stage)
+{
+    return histogram_names[STATS_STAGES + stage];
+}
+
+void stats_reset(void)
+{
+    int i = 0;
+
+    babble_mutex_lock(&stats_lock);
+    for (i = 0; i < STATS_NB_HISTOGRAMS; i++)
+    {
+        merge_histogram(i, &baseline[i]);
+    }
+    baseline_date = stats_now();
+    babble_mutex_unlock(&stats_lock);
+}
+
+/* writes "<name> count=... max=...\n" */
+static void format_histogram(fmt_buf_t *f, const char *name, histogram_t *h, uint64_t elapsed_ms)
+{
+    fmt_str(f, name);
+    fmt_lit(f, " count=");
+    fmt_ulong(f, h->count);
+    fmt_lit(f, " rate=");
+    fmt_ulong(f, (elapsed_ms == 0) ? 0 : h->count * 1000 / elapsed_ms);
+    fmt_lit(f, "/s mean=");
+    fmt_ulong(f, histogram_mean(h));
+    fmt_lit(f, " p50=");
+    fmt_ulong(f, histogram_percentile(h, 50.0));
+    fmt_lit(f, " p90=");
+    fmt_ulong(f, histogram_percentile(h, 90.0));
+    fmt_lit(f, " p99=");
+    fmt_ulong(f, histogram_percentile(h, 99.0));
+    fmt_lit(f, " p999=");
+    fmt_ulong(f, histogram_percentile(h, 99.9));
+    fmt_lit(f, " max=");
+    fmt_ulong(f, histogram_max(h));
+    fmt_lit(f, "\n");
+}
+
+void stats_format_commands(fmt_buf_t *f)
+{
+    histogram_t h;
+    uint64_t elapsed_ms = 0;
+    int i = 0;
+
+    babble_mutex_lock(&stats_lock);
+    elapsed_ms = (stats_now() - baseline_date) / 1000000;
+
+    fmt_lit(f, "stats over ");
+    fmt_ulong(f, elapsed_ms);
+    fmt_lit(f, " ms, latencies in ns\n");
+
+    for (i = 0; i < STATS_NB_HISTOGRAMS; i++)
+    {
+        if (i == STATS_STAGES)
+        {
+            fmt_lit(f, "stages of the queued commands:\n");
+        }
+        merge_histogram(i, &h);
+        histogram_sub(&h, &baseline[i]);
+        format_histogram(f, histogram_names[i], &h, elapsed_ms);
+    }
+    babble_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,83 @@
+#ifndef __BABBLE_STATS_H__
+#define __BABBLE_STATS_H__
+
+#include <stdint.h>
+
+#include "babble_types.h"
+#include "babble_format.h"
+#include "babble_histogram.h"
+
+/**** Server statistics ****/
+
+/* the latency of each command type is recorded in a histogram (see
+ * babble_histogram.h). Each thread records in its own shard, picked
+ * among BABBLE_STATS_SHARDS at its first record, so that recording
+ * takes no lock; the shards are merged when a report is generated */
+
+/* the command types that are timed: LOGIN to RDV */
+#define STATS_NB_COMMANDS (RDV + 1)
+
+/* counters, sharded like the histograms; they are never reset */
+typedef enum{
+    STATS_BYTES_IN = 0,  /* request bytes, one counter per command type */
+    STATS_BYTES_OUT = STATS_BYTES_IN + STATS_NB_COMMANDS, /* answer bytes */
+    STATS_ENQUEUED = STATS_BYTES_OUT + STATS_NB_COMMANDS, /* pushed to cmd_buff */
+    STATS_DEQUEUED,      /* taken from cmd_buff */
+    STATS_EXECUTOR_BUSY, /* ns spent by the executors on commands */
+    STATS_FANOUT_EDGES,  /* publications inserted in a timeline */
+    STATS_TIMELINE_OVERFLOWS, /* TIMELINE answers missing publications */
+    STATS_TIMELINE_DROPPED,   /* publications missing from them */
+    STATS_NB_COUNTERS
+} stats_counter_t;
+
+void stats_init(void);
+
+void stats_add(stats_counter_t counter, uint64_t v);
+
+/* accounts the bytes of the request and of the answer of a command of
+ * type cid */
+void stats_record_bytes(command_id cid, uint64_t bytes_in, uint64_t bytes_out);
+
+/* sum of the shards of counter */
+uint64_t stats_counter(stats_counter_t counter);
+
+/* merges the shards of the histogram of a command type, or of a stage
+ * (STATS_NB_STAGES for the total), into h; the values are not reset by
+ * stats_reset() */
+void stats_command_histogram(command_id cid, histogram_t *h);
+void stats_stage_histogram(int stage, histogram_t *h);
+
+const char *stats_command_name(command_id cid);
+const char *stats_stage_name(int stage);
+
+/* monotonic date in ns */
+uint64_t stats_now(void);
+
+/* records that a command of type cid ran during ns nanoseconds */
+void stats_record_command(command_id cid, uint64_t ns);
+
+/* the life of a command is split into the stages between two
+ * consecutive stamps: reception (recv -> enqueue), queueing (enqueue
+ * -> dequeue), service (dequeue -> executed) and output (executed ->
+ * sent) */
+#define STATS_NB_STAGES (NB_STAMPS - 1)
+
+static inline void command_stamp(command_t *cmd, command_stamp_t stamp)
+{
+    cmd->dates[stamp] = stats_now();
+}
+
+/* records the duration of each stage of cmd, and its total duration,
+ * and the time its executor spent on it; all stamps have to be set */
+void stats_record_lifecycle(command_t *cmd);
+
+/* restarts the statistics: the values recorded so far are no longer
+ * reported */
+void stats_reset(void);
+
+/* writes the report of the commands: one line per command type, then
+ * one line per stage of the queued commands, with the count,
+ * throughput and latency percentiles since the last reset */
+void stats_format_commands(fmt_buf_t *f);
+
+#endif
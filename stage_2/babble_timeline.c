@@ -2,87 +2,317 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
 
 #include "babble_timeline.h"
 #include "babble_server.h"
 #include "babble_communication.h"
+#include "babble_slab.h"
+#include "babble_format.h"
+#include "babble_stats.h"
+#include "babble_probes.h"
+#include "babble_memory.h"
+
+/* used to order publications across timelines */
+static unsigned long publication_seq = 0;
+
+publication_t* publication_create(client_bundle_t *publisher, char *msg)
+{
+    struct timespec tt;
+    time_t date;
+    size_t msg_len, len;
+
+    clock_gettime(CLOCK_REALTIME, &tt);
+    date = tt.tv_sec - server_start;
+
+    /* the line is formatted directly in the publication */
+    msg_len = strnlen(msg, BABBLE_PUBLICATION_SIZE);
+    len = format_publication_len(publisher, date, msg_len);
+    if(len >= BABBLE_BUFFER_SIZE){
+        len = BABBLE_BUFFER_SIZE - 1;
+    }
+
+    publication_t *pub = malloc(sizeof(publication_t) + len + 1);
+    mem_account_alloc(MEM_TIMELINES, sizeof(publication_t) + len + 1);
+    pub->refcount = 1;
+    pub->date = date;
+    pub->seq = __sync_fetch_and_add(&publication_seq, 1);
+    pub->size = len + 1;
+    format_publication(pub->msg, len + 1, publisher, date, msg, msg_len);
+
+    return pub;
+}
+
+void publication_get(publication_t *pub)
+{
+    __sync_fetch_and_add(&pub->refcount, 1);
+}
+
+void publication_put(publication_t *pub)
+{
+    if(pub != NULL && __sync_sub_and_fetch(&pub->refcount, 1) == 0){
+        mem_account_free(MEM_TIMELINES, sizeof(publication_t) + pub->size);
+        free(pub);
+    }
+}
+
+static slab_cache_t timeline_cache;
+
+void timeline_init(void)
+{
+    slab_cache_init(&timeline_cache, "timeline", sizeof(timeline_t), __alignof__(timeline_t));
+}
 
 timeline_t* timeline_create(unsigned long client_key)
 {
-    timeline_t* tm= malloc(sizeof(timeline_t));
-    tm->youngest = 0;
-    tm->count_recent_adds = 0;
+    timeline_t* tm= slab_alloc(&timeline_cache);
+    mem_account_alloc(MEM_TIMELINES, sizeof(timeline_t));
+    memset(tm->circular_buffer, 0, sizeof(tm->circular_buffer));
+    tm->head = 0;
+    tm->cursor = 0;
     tm->key = client_key;
-    pthread_mutex_init(&tm->lock, NULL);
     return tm;
 }
 
 void timeline_free(timeline_t *timeline)
 {
-    pthread_mutex_destroy(&timeline->lock);
-    free(timeline);
+    int i = 0;
+
+    for(i = 0; i < BABBLE_TIMELINE_MAX; i++){
+        publication_put(timeline->circular_buffer[i].pub);
+    }
+    slab_free(&timeline_cache, timeline);
+    mem_account_free(MEM_TIMELINES, sizeof(timeline_t));
 }
 
 
-time_t timeline_insert(timeline_t *tm, client_bundle_t *publisher, char *msg)
+void timeline_insert(timeline_t *tm, publication_t *pub)
 {
-    pthread_mutex_lock(&tm->lock);
-    struct timespec tt;
-    
-    publication_t *pub= &tm->circular_buffer[tm->youngest];
-    
-    clock_gettime(CLOCK_REALTIME, &tt);
-    
-    memset(pub->msg, 0, BABBLE_PUBLICATION_SIZE);    
-    strncpy(pub->msg, msg, BABBLE_PUBLICATION_SIZE);
+    publication_t *evicted = NULL;
+    unsigned long pos, prev;
+    timeline_slot_t *slot;
+
+    publication_get(pub);
+    stats_add(STATS_FANOUT_EDGES, 1);
+    BABBLE_PROBE2(timeline__insert, tm, pub->seq);
+
+    /* reserve a position */
+    pos = __atomic_fetch_add(&tm->head, 1, __ATOMIC_SEQ_CST);
+    slot = &tm->circular_buffer[pos % BABBLE_TIMELINE_MAX];
+
+    /* wait for the writer of the previous lap to be done with the slot */
+    prev = (pos < BABBLE_TIMELINE_MAX)? 0 : pos - BABBLE_TIMELINE_MAX + 1;
+    while(!__atomic_compare_exchange_n(&slot->seq, &prev, TIMELINE_SLOT_BUSY, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+        prev = (pos < BABBLE_TIMELINE_MAX)? 0 : pos - BABBLE_TIMELINE_MAX + 1;
+        sched_yield();
+    }
+
+    /* readers that saw the old sequence number may still be taking a
+     * reference on the old publication */
+    while(__atomic_load_n(&slot->pins, __ATOMIC_SEQ_CST) != 0){
+        sched_yield();
+    }
+
+    evicted = slot->pub;
+    slot->pub = pub;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    publication_put(evicted);
+}
 
-    pub->date = tt.tv_sec - server_start;
-    snprintf(pub->msg, BABBLE_BUFFER_SIZE,"    %s[%ld]: %s\n", publisher->client_name, pub->date, msg);
-    
-    /* shifting the index */
-    tm->youngest = (tm->youngest + 1) % BABBLE_TIMELINE_MAX;
+/* takes a reference on the publication at position pos; returns NULL
+ * if it has already been overwritten */
+static publication_t *timeline_take(timeline_t *tm, unsigned long pos)
+{
+    timeline_slot_t *slot = &tm->circular_buffer[pos % BABBLE_TIMELINE_MAX];
+    publication_t *pub = NULL;
+    unsigned long seq;
 
-    tm->count_recent_adds++;
+    while(1){
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq == TIMELINE_SLOT_BUSY || seq < pos + 1){
+            /* the position is being written */
+            sched_yield();
+            continue;
+        }
+        if(seq > pos + 1){
+            return NULL;
+        }
 
-    pthread_mutex_unlock(&tm->lock);
+        __atomic_fetch_add(&slot->pins, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == pos + 1){
+            pub = slot->pub;
+            publication_get(pub);
+        }
+        __atomic_fetch_sub(&slot->pins, 1, __ATOMIC_SEQ_CST);
 
-    return pub->date;
+        if(pub != NULL){
+            return pub;
+        }
+    }
+}
+
+/* moves the summary cursor to the current head; the positions in
+ * [*first, returned value) are the new publications */
+static unsigned long timeline_advance_cursor(timeline_t *tm, unsigned long *first)
+{
+    unsigned long c = __atomic_load_n(&tm->cursor, __ATOMIC_ACQUIRE);
+    unsigned long h;
+
+    do{
+        h = __atomic_load_n(&tm->head, __ATOMIC_ACQUIRE);
+    }while(!__atomic_compare_exchange_n(&tm->cursor, &c, h, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+
+    *first = c;
+    return h;
+}
+
+/* accounts the publications that do not fit in a TIMELINE answer */
+static void count_overflow(unsigned long count)
+{
+    if(count > BABBLE_TIMELINE_MAX){
+        stats_add(STATS_TIMELINE_OVERFLOWS, 1);
+        stats_add(STATS_TIMELINE_DROPPED, count - BABBLE_TIMELINE_MAX);
+    }
 }
 
 void timeline_generate_summary(timeline_t *tm, answer_t **answer)
 {
-    pthread_mutex_lock(&tm->lock);
     answer_t *the_answer=NULL;
-    unsigned int index_first=0;
+    publication_t *pubs[BABBLE_TIMELINE_MAX];
+    unsigned int nb_pubs=0, count=0, i=0;
+    unsigned long first, last, pos;
+
+    last = timeline_advance_cursor(tm, &first);
+    count = last - first;
+    count_overflow(count);
+
+    /* only the BABBLE_TIMELINE_MAX most recent ones are returned */
+    pos = (count > BABBLE_TIMELINE_MAX)? last - BABBLE_TIMELINE_MAX : first;
+    for(; pos < last; pos++){
+        pubs[nb_pubs] = timeline_take(tm, pos);
+        if(pubs[nb_pubs] != NULL){
+            nb_pubs++;
+        }
+    }
 
     the_answer = alloc_answer(tm->key);
-    
+
     /* the first msg of the answer is the number of publications since
-     * the last call to timeline */    
-    add_msg_to_answer(the_answer, sizeof(unsigned int), &tm->count_recent_adds);
-
-    /* compute the index of the first msg to add to the timeline */
-    if(tm->count_recent_adds >= BABBLE_TIMELINE_MAX){
-        index_first = tm->youngest;
-        
-        /* deal with the corner case where the buffer is full */
-        add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, &tm->circular_buffer[index_first]);
-        index_first = (index_first + 1) % BABBLE_TIMELINE_MAX;
+     * the last call to timeline */
+    add_msg_to_answer(the_answer, sizeof(unsigned int), &count);
+
+    for(i = 0; i < nb_pubs; i++){
+        add_msg_to_answer(the_answer, pubs[i]->size, pubs[i]->msg);
+        publication_put(pubs[i]);
+    }
+
+    *answer = the_answer;
+}
+
+unsigned long timeline_nb_inserts(timeline_t *tm)
+{
+    return __atomic_load_n(&tm->head, __ATOMIC_ACQUIRE);
+}
+
+void timeline_selection_init(timeline_selection_t *sel)
+{
+    sel->nb_items = 0;
+    sel->count = 0;
+}
+
+/* adds pub to the selection if it is one of the BABBLE_TIMELINE_MAX
+ * most recent publications seen so far; returns 0 if pub was too old */
+/* the reference held by the caller on pub is given to the selection */
+static int timeline_selection_offer(timeline_selection_t *sel, publication_t *pub)
+{
+    int i = 0;
+
+    if(sel->nb_items == BABBLE_TIMELINE_MAX){
+        if(pub->seq < sel->items[0]->seq){
+            publication_put(pub);
+            return 0;
+        }
+        /* evict the oldest item */
+        publication_put(sel->items[0]);
+        memmove(&sel->items[0], &sel->items[1], (BABBLE_TIMELINE_MAX - 1) * sizeof(publication_t *));
+        sel->nb_items--;
+    }
+
+    /* keep the items sorted by seq */
+    i = sel->nb_items;
+    while(i > 0 && sel->items[i-1]->seq > pub->seq){
+        sel->items[i] = sel->items[i-1];
+        i--;
+    }
+    sel->items[i] = pub;
+    sel->nb_items++;
+
+    return 1;
+}
+
+/* offers the publications at positions [first, last) to sel, from the
+ * most recent one: timelines are sorted, which allows stopping at the
+ * first one that is too old to be selected */
+static void timeline_offer_range(timeline_t *tm, unsigned long first, unsigned long last, timeline_selection_t *sel)
+{
+    publication_t *pub = NULL;
+    unsigned long pos = last;
+
+    sel->count += last - first;
+
+    if(last - first > BABBLE_TIMELINE_MAX){
+        first = last - BABBLE_TIMELINE_MAX;
     }
-    else{
-        index_first = (BABBLE_TIMELINE_MAX + tm->youngest - tm->count_recent_adds) % BABBLE_TIMELINE_MAX;
+
+    while(pos > first){
+        pos--;
+        pub = timeline_take(tm, pos);
+        if(pub != NULL && !timeline_selection_offer(sel, pub)){
+            break;
+        }
     }
-    
-    /* add all new msgs in the timeline */
-    while(index_first != tm->youngest ){
-        add_msg_to_answer(the_answer, BABBLE_BUFFER_SIZE, &tm->circular_buffer[index_first]);
+}
 
-        index_first = (index_first + 1) % BABBLE_TIMELINE_MAX;
+void timeline_pull(timeline_t *outbox, unsigned long *cursor, timeline_selection_t *sel)
+{
+    unsigned long last = timeline_nb_inserts(outbox);
+
+    /* most outboxes did not change since the last pull */
+    if(last == *cursor){
+        return;
     }
 
-    tm->count_recent_adds = 0;
+    timeline_offer_range(outbox, *cursor, last, sel);
+    *cursor = last;
+}
+
+void timeline_take_recent(timeline_t *tm, timeline_selection_t *sel)
+{
+    unsigned long first, last;
+
+    last = timeline_advance_cursor(tm, &first);
+    timeline_offer_range(tm, first, last, sel);
+}
+
+void timeline_selection_generate_summary(timeline_selection_t *sel, unsigned long key, answer_t **answer)
+{
+    answer_t *the_answer=NULL;
+    unsigned int i=0;
+
+    the_answer = alloc_answer(key);
+    count_overflow(sel->count);
+
+    /* same layout as the answer of timeline_generate_summary() */
+    add_msg_to_answer(the_answer, sizeof(unsigned int), &sel->count);
+
+    for(i = 0; i < sel->nb_items; i++){
+        add_msg_to_answer(the_answer, sel->items[i]->size, sel->items[i]->msg);
+        publication_put(sel->items[i]);
+    }
+    sel->nb_items = 0;
 
-    pthread_mutex_unlock(&tm->lock);
-    
     *answer = the_answer;
 }
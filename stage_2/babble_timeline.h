@@ -10,31 +10,92 @@
 #include "babble_types.h"
 
 /* a publication */
+/* it is formatted once, and then shared (read-only) by all the
+ * timelines it is inserted in; it is freed when the last reference
+ * is dropped */
 typedef struct publication{
-    char msg[BABBLE_BUFFER_SIZE];
+    int refcount;
     time_t date;
+    unsigned long seq; /* global order of the publications */
+    unsigned int size; /* size of msg, including the final '\0' */
+    char msg[]; /* the line sent to the readers */
 } publication_t;
 
+/* creates a publication of publisher, with a single reference */
+publication_t* publication_create(client_bundle_t *publisher, char *msg);
+
+/* takes/drops a reference on pub */
+void publication_get(publication_t *pub);
+void publication_put(publication_t *pub);
+
+
+/* a slot of the timeline */
+typedef struct timeline_slot{
+    publication_t *pub;
+    unsigned long seq; /* position of pub in the timeline + 1, 0 if
+                        * the slot is empty, TIMELINE_SLOT_BUSY while a
+                        * writer replaces pub */
+    int pins; /* nb of readers taking a reference on pub */
+} timeline_slot_t;
+
+#define TIMELINE_SLOT_BUSY (~0UL)
 
 /* the timeline */
-/* it is implemented as a circular buffer of fixed size */
+/* it is implemented as a lock-free circular buffer of fixed size,
+ * storing references to publications. Writers reserve a position by
+ * incrementing head; the publication at position p goes to slot
+ * p % BABBLE_TIMELINE_MAX, whose sequence number tells which
+ * position it currently holds. Readers take a snapshot of the
+ * positions [cursor, head) without blocking writers. */
 typedef struct timeline{
-    publication_t circular_buffer[BABBLE_TIMELINE_MAX];
-    unsigned int youngest; /* index of the most recent message */
-    unsigned int count_recent_adds; /* count the numbers of inserts
-                                     * since the last summary */
+    timeline_slot_t circular_buffer[BABBLE_TIMELINE_MAX];
+    unsigned long head; /* nb of inserts, ie next position to fill */
+    unsigned long cursor; /* first position not included in a summary */
     unsigned long key; /* key of associated client */
-    pthread_mutex_t lock; //mutex for safety
 }timeline_t;
 
 /* instanciate a new timeline */
+/* has to be called once before timelines are created */
+void timeline_init(void);
+
 timeline_t* timeline_create(unsigned long client_key);
 void timeline_free(timeline_t *timeline);
 
-/* inserts msg in the timeline tm */
-time_t timeline_insert(timeline_t *tm, client_bundle_t *publisher, char *msg);
+/* inserts pub in the timeline tm (a reference is taken) */
+void timeline_insert(timeline_t *tm, publication_t *pub);
 
 /* generates a timeline answer */
 void timeline_generate_summary(timeline_t *tm, answer_t** answer);
 
+/* pull mode: instead of being pushed into the timelines of the
+ * followers, publications are only inserted in the timeline of their
+ * author (its outbox). The timeline of a reader is assembled on
+ * demand by merging the outboxes of the clients it follows. */
+
+/* the most recent publications found while merging outboxes, sorted
+ * from the oldest to the most recent (the selection holds a reference
+ * on each of them) */
+typedef struct timeline_selection{
+    publication_t *items[BABBLE_TIMELINE_MAX];
+    unsigned int nb_items;
+    unsigned int count; /* nb of publications found since the cursors */
+} timeline_selection_t;
+
+/* total nb of publications inserted in tm */
+unsigned long timeline_nb_inserts(timeline_t *tm);
+
+void timeline_selection_init(timeline_selection_t *sel);
+
+/* merges the publications inserted in outbox after *cursor into sel,
+ * and moves the cursor after the last of them */
+void timeline_pull(timeline_t *outbox, unsigned long *cursor, timeline_selection_t *sel);
+
+/* merges the publications inserted in tm since the last summary into
+ * sel (hybrid mode: tm is the timeline publications are pushed to) */
+void timeline_take_recent(timeline_t *tm, timeline_selection_t *sel);
+
+/* generates a timeline answer out of a selection, and releases the
+ * publications of the selection */
+void timeline_selection_generate_summary(timeline_selection_t *sel, unsigned long key, answer_t **answer);
+
 #endif
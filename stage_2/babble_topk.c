@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "babble_topk.h"
+#include "babble_config.h"
+#include "babble_format.h"
+#include "babble_registration.h"
+
+typedef struct topk_counter
+{
+    unsigned long key;
+    uint64_t count;
+    uint64_t error; /* count may exceed the real value by error */
+} topk_counter_t;
+
+/* hints[] maps a hash of a key to the counter that last held it, so
+ * that a tracked client is found without scanning the counters */
+typedef struct topk_sketch
+{
+    unsigned int nb_used;
+    topk_counter_t counters[BABBLE_TOPK_CAPACITY];
+    unsigned char hints[BABBLE_TOPK_HINTS];
+} topk_sketch_data_t;
+
+/* the sketches of a thread are only written by that thread, without
+ * lock; the reports read them with relaxed loads. As the log rings,
+ * the sketches of an exiting thread are adopted, with their counts, by
+ * the next thread that records */
+typedef struct topk_set
+{
+    unsigned long epoch; /* cleared by the owner when older than topk_epoch */
+    int in_use;          /* set while a thread owns the set */
+    struct topk_set *next;
+    topk_sketch_data_t sketches[NB_TOPK_SKETCHES];
+} BABBLE_CACHELINE_ALIGNED topk_set_t;
+
+static topk_set_t *set_list = NULL;
+static __thread topk_set_t *my_set = NULL;
+
+static pthread_key_t set_key;
+static pthread_once_t set_key_once = PTHREAD_ONCE_INIT;
+
+/* incremented by topk_reset() */
+static unsigned long topk_epoch = 0;
+
+static const char *sketch_names[NB_TOPK_SKETCHES] = {
+    "fanout_edges", "commands", "bytes_sent"};
+
+static void release_set(void *arg)
+{
+    topk_set_t *set = arg;
+
+    my_set = NULL;
+    __atomic_store_n(&set->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_set_key(void)
+{
+    pthread_key_create(&set_key, release_set);
+}
+
+/* returns the sketches of the calling thread, adopting or creating
+ * them */
+static topk_set_t *get_set(void)
+{
+    topk_set_t *set = NULL;
+    int free_set = 0;
+
+    pthread_once(&set_key_once, create_set_key);
+
+    for (set = __atomic_load_n(&set_list, __ATOMIC_ACQUIRE); set != NULL; set = set->next)
+    {
+        free_set = 0;
+        if (__atomic_compare_exchange_n(&set->in_use, &free_set, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (set == NULL)
+    {
+        if (posix_memalign((void **)&set, BABBLE_CACHELINE_SIZE, sizeof(topk_set_t)))
+        {
+            return NULL;
+        }
+        memset(set, 0, sizeof(topk_set_t));
+        set->epoch = __atomic_load_n(&topk_epoch, __ATOMIC_RELAXED);
+        set->in_use = 1;
+        set->next = __atomic_load_n(&set_list, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&set_list, &set->next, set, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    pthread_setspecific(set_key, set);
+    return set;
+}
+
+static unsigned int key_hint(unsigned long key)
+{
+    return ((key * 0x9E3779B97F4A7C15ULL) >> 56) & (BABBLE_TOPK_HINTS - 1);
+}
+
+static void sketch_add(topk_sketch_data_t *s, unsigned long key, uint64_t weight)
+{
+    topk_counter_t *c = &s->counters[s->hints[key_hint(key)]];
+    topk_counter_t *min = NULL;
+    unsigned int i = 0;
+
+    if (c->key == key && c->count != 0)
+    {
+        __atomic_store_n(&c->count, c->count + weight, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (i = 0; i < s->nb_used; i++)
+    {
+        if (s->counters[i].key == key)
+        {
+            s->hints[key_hint(key)] = i;
+            __atomic_store_n(&s->counters[i].count, s->counters[i].count + weight, __ATOMIC_RELAXED);
+            return;
+        }
+        if (min == NULL || s->counters[i].count < min->count)
+        {
+            min = &s->counters[i];
+        }
+    }
+
+    if (s->nb_used < BABBLE_TOPK_CAPACITY)
+    {
+        min = &s->counters[s->nb_used];
+        __atomic_store_n(&min->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->nb_used, s->nb_used + 1, __ATOMIC_RELEASE);
+    }
+
+    /* the new client may have been counted in the evicted counter */
+    s->hints[key_hint(key)] = min - s->counters;
+    __atomic_store_n(&min->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->error, min->count, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->count, min->count + weight, __ATOMIC_RELAXED);
+}
+
+void topk_record(topk_sketch_t sketch, unsigned long key, uint64_t weight)
+{
+    unsigned long epoch = __atomic_load_n(&topk_epoch, __ATOMIC_RELAXED);
+
+    if (my_set == NULL && (my_set = get_set()) == NULL)
+    {
+        return;
+    }
+
+    /* reset since the last record */
+    if (my_set->epoch != epoch)
+    {
+        memset(my_set->sketches, 0, sizeof(my_set->sketches));
+        __atomic_store_n(&my_set->epoch, epoch, __ATOMIC_RELEASE);
+    }
+
+    sketch_add(&my_set->sketches[sketch], key, weight);
+}
+
+/* the sets are cleared by their owner at its next record, and ignored
+ * by the reports meanwhile */
+void topk_reset(void)
+{
+    __atomic_fetch_add(&topk_epoch, 1, __ATOMIC_RELAXED);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const topk_counter_t *c1 = a;
+    const topk_counter_t *c2 = b;
+
+    return (c1->key > c2->key) - (c1->key < c2->key);
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+    const topk_counter_t *c1 = a;
+    const topk_counter_t *c2 = b;
+
+    return (c1->count < c2->count) - (c1->count > c2->count);
+}
+
+/* copies the counters of sketch of the sets of the current epoch to
+ * *counters (reallocated); returns their nb. A counter being replaced
+ * may be read with the key of a client and the count of another */
+static unsigned int copy_sketches(topk_sketch_t sketch, topk_counter_t **counters, unsigned int *size)
+{
+    unsigned long epoch = __atomic_load_n(&topk_epoch, __ATOMIC_RELAXED);
+    topk_sketch_data_t *s = NULL;
+    topk_set_t *set = NULL;
+    unsigned int nb = 0, nb_used = 0, i = 0;
+
+    for (set = __atomic_load_n(&set_list, __ATOMIC_ACQUIRE); set != NULL; set = set->next)
+    {
+        if (__atomic_load_n(&set->epoch, __ATOMIC_ACQUIRE) != epoch)
+        {
+            continue;
+        }
+
+        s = &set->sketches[sketch];
+        nb_used = __atomic_load_n(&s->nb_used, __ATOMIC_ACQUIRE);
+        if (nb + nb_used > *size)
+        {
+            *size = 2 * (nb + nb_used);
+            *counters = realloc(*counters, *size * sizeof(topk_counter_t));
+        }
+
+        for (i = 0; i < nb_used; i++)
+        {
+            (*counters)[nb].key = __atomic_load_n(&s->counters[i].key, __ATOMIC_RELAXED);
+            (*counters)[nb].count = __atomic_load_n(&s->counters[i].count, __ATOMIC_RELAXED);
+            (*counters)[nb].error = __atomic_load_n(&s->counters[i].error, __ATOMIC_RELAXED);
+            if ((*counters)[nb].error > (*counters)[nb].count)
+            {
+                (*counters)[nb].error = (*counters)[nb].count;
+            }
+            nb++;
+        }
+    }
+
+    return nb;
+}
+
+/* merges the sketches of all threads into *counters (one per client,
+ * the errors add up); returns the nb of clients */
+static unsigned int merge_sketch(topk_sketch_t sketch, topk_counter_t **counters, unsigned int *size)
+{
+    unsigned int nb = copy_sketches(sketch, counters, size), merged = 0, i = 0;
+    topk_counter_t *c = *counters;
+
+    qsort(c, nb, sizeof(topk_counter_t), compare_keys);
+    for (i = 0; i < nb; i++)
+    {
+        if (merged > 0 && c[merged - 1].key == c[i].key)
+        {
+            c[merged - 1].count += c[i].count;
+            c[merged - 1].error += c[i].error;
+        }
+        else
+        {
+            c[merged++] = c[i];
+        }
+    }
+
+    qsort(c, merged, sizeof(topk_counter_t), compare_counts);
+    return merged;
+}
+
+void topk_format_report(fmt_buf_t *f)
+{
+    topk_counter_t *counters = NULL;
+    client_bundle_t *client = NULL;
+    unsigned int nb = 0, size = 0, i = 0;
+    int sketch = 0;
+
+    for (sketch = 0; sketch < NB_TOPK_SKETCHES; sketch++)
+    {
+        nb = merge_sketch(sketch, &counters, &size);
+
+        fmt_lit(f, "top ");
+        fmt_str(f, sketch_names[sketch]);
+        fmt_lit(f, ":\n");
+
+        for (i = 0; i < nb && i < BABBLE_TOPK_REPORT; i++)
+        {
+            /* the client may be gone */
+            if ((client = registration_lookup(counters[i].key)) != NULL)
+            {
+                fmt_str(f, client->client_name);
+            }
+            else
+            {
+                fmt_lit(f, "key_");
+                fmt_ulong(f, counters[i].key);
+            }
+            fmt_lit(f, " count=");
+            fmt_ulong(f, counters[i].count);
+            fmt_lit(f, " min=");
+            fmt_ulong(f, counters[i].count - counters[i].error);
+            fmt_lit(f, "\n");
+        }
+    }
+
+    free(counters);
+}
@@ -0,0 +1,35 @@
+#ifndef __BABBLE_TOPK_H__
+#define __BABBLE_TOPK_H__
+
+#include <stdint.h>
+
+/**** Heaviest clients ****/
+
+/* the clients with the most fan-out edges written, commands issued
+ * and bytes sent are tracked by space-saving sketches of
+ * BABBLE_TOPK_CAPACITY counters: a client that is not tracked takes
+ * the counter of the lightest tracked client, and inherits its count
+ * as error. Any client weighing more than 1/BABBLE_TOPK_CAPACITY of
+ * the records of a thread is tracked by that thread. Each thread
+ * updates its own sketches without lock; they are merged by the
+ * report (STATS TOP). */
+
+typedef enum{
+    TOPK_FANOUT_EDGES = 0, /* timelines written by the publications */
+    TOPK_COMMANDS,         /* commands issued */
+    TOPK_BYTES_SENT,       /* bytes of the answers */
+    NB_TOPK_SKETCHES
+} topk_sketch_t;
+
+/* adds weight to the client of key in sketch */
+void topk_record(topk_sketch_t sketch, unsigned long key, uint64_t weight);
+
+void topk_reset(void);
+
+struct fmt_buf;
+
+/* writes the BABBLE_TOPK_REPORT heaviest clients of each sketch, with
+ * their count and the lower bound of their count */
+void topk_format_report(struct fmt_buf *f);
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "babble_trace.h"
+#include "babble_log.h"
+
+#ifdef BABBLE_TRACE
+
+int trace_enabled = 0;
+
+typedef struct trace_ring
+{
+    unsigned long head;  /* nb of events written, only by the owner */
+    uint64_t tid;
+    int in_use;          /* set while a thread owns the ring */
+    struct trace_ring *next;
+    trace_event_t events[BABBLE_TRACE_RING_SIZE];
+} trace_ring_t;
+
+/* as the log rings, trace rings are never freed: the ring of an
+ * exiting thread is adopted by the next thread that traces */
+static trace_ring_t *ring_list = NULL;
+static __thread trace_ring_t *my_ring = NULL;
+static pthread_key_t ring_key;
+
+static uint64_t slow_threshold = 0;
+static uint64_t last_slow_dump = 0;
+
+/* posted by the signal handler and the slow requests */
+static sem_t dump_sem;
+static pthread_t dump_thread;
+static unsigned int nb_dumps = 0;
+
+uint64_t trace_now(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return (uint64_t)tt.tv_sec * 1000000000ULL + tt.tv_nsec;
+}
+
+static void release_ring(void *arg)
+{
+    trace_ring_t *ring = arg;
+
+    /* destructors running after this one (slab_thread_exit() may
+     * trace lock waits) must not write into a ring another thread may
+     * have adopted */
+    my_ring = NULL;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static trace_ring_t *get_ring(void)
+{
+    trace_ring_t *ring = NULL;
+    int free_ring = 0;
+
+    for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (ring == NULL)
+    {
+        if ((ring = calloc(1, sizeof(trace_ring_t))) == NULL)
+        {
+            return NULL;
+        }
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&ring_list, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    ring->tid = syscall(SYS_gettid);
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+void trace_record(trace_event_type_t type, uint64_t date, uint64_t duration, uint64_t arg, uint32_t arg2)
+{
+    trace_event_t *e = NULL;
+    unsigned long head;
+
+    if (my_ring == NULL && (my_ring = get_ring()) == NULL)
+    {
+        return;
+    }
+
+    head = my_ring->head;
+    e = &my_ring->events[head % BABBLE_TRACE_RING_SIZE];
+    e->date = date;
+    e->duration = duration;
+    e->arg = arg;
+    e->arg2 = arg2;
+    e->type = type;
+    __atomic_store_n(&my_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_slow_request(uint64_t duration)
+{
+    uint64_t now, last;
+
+    if (slow_threshold == 0 || duration < slow_threshold)
+    {
+        return;
+    }
+
+    /* at most one dump per second, the first slow request wins */
+    now = trace_now();
+    last = __atomic_load_n(&last_slow_dump, __ATOMIC_RELAXED);
+    if (now - last > 1000000000ULL
+        && __atomic_compare_exchange_n(&last_slow_dump, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        sem_post(&dump_sem);
+    }
+}
+
+/* the events are copied while the threads go on writing: the slots
+ * their owner may have overwritten during the copy are discarded, as
+ * in a seqlock */
+static void dump_rings(void)
+{
+    char path[BABBLE_BUFFER_SIZE];
+    trace_ring_header_t header;
+    trace_ring_t *ring = NULL;
+    trace_event_t *copy = NULL;
+    unsigned long head, first, i;
+    FILE *file = NULL;
+
+    snprintf(path, sizeof(path), "babble_trace.%d.%u", (int)getpid(), nb_dumps++);
+    if ((copy = malloc(BABBLE_TRACE_RING_SIZE * sizeof(trace_event_t))) == NULL
+        || (file = fopen(path, "w")) == NULL)
+    {
+        log_error("could not open trace file %s", path);
+        free(copy);
+        return;
+    }
+
+    for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        first = (head > BABBLE_TRACE_RING_SIZE) ? head - BABBLE_TRACE_RING_SIZE : 0;
+
+        for (i = first; i < head; i++)
+        {
+            copy[i % BABBLE_TRACE_RING_SIZE] = ring->events[i % BABBLE_TRACE_RING_SIZE];
+        }
+
+        /* the owner may be writing event head2 (not yet counted), which
+         * overwrites event head2 - BABBLE_TRACE_RING_SIZE: the events
+         * older than head2 + 1 - BABBLE_TRACE_RING_SIZE may be torn */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        i = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+        if (i > BABBLE_TRACE_RING_SIZE && i - BABBLE_TRACE_RING_SIZE > first)
+        {
+            first = (i - BABBLE_TRACE_RING_SIZE < head) ? i - BABBLE_TRACE_RING_SIZE : head;
+        }
+
+        header.magic = TRACE_DUMP_MAGIC;
+        header.tid = ring->tid;
+        header.nb_events = head - first;
+        fwrite(&header, sizeof(header), 1, file);
+
+        for (i = first; i < head; i++)
+        {
+            fwrite(&copy[i % BABBLE_TRACE_RING_SIZE], sizeof(trace_event_t), 1, file);
+        }
+    }
+
+    fclose(file);
+    free(copy);
+    log_info("### trace dumped to %s", path);
+}
+
+static void *dump_loop(void *arg)
+{
+    while (1)
+    {
+        if (sem_wait(&dump_sem) == 0)
+        {
+            dump_rings();
+        }
+    }
+    return NULL;
+}
+
+static void sigusr1_handler(int sig)
+{
+    sem_post(&dump_sem);
+}
+
+int trace_init(unsigned int slow_ms)
+{
+    struct sigaction sa;
+
+    pthread_key_create(&ring_key, release_ring);
+    sem_init(&dump_sem, 0, 0);
+    slow_threshold = (uint64_t)slow_ms * 1000000;
+
+    sa.sa_handler = sigusr1_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    pthread_create(&dump_thread, NULL, dump_loop, NULL);
+    pthread_detach(dump_thread);
+
+    trace_enabled = 1;
+    return 0;
+}
+
+#else
+
+int trace_init(unsigned int slow_ms)
+{
+    fprintf(stderr, "Error -- tracing is not compiled in (build with TRACE=1)\n");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef __BABBLE_TRACE_H__
+#define __BABBLE_TRACE_H__
+
+#include <stdint.h>
+
+#include "babble_config.h"
+
+/**** Flight recorder ****/
+
+/* when tracing is enabled (-T option of the server), each thread
+ * writes fixed-size events into its own ring of BABBLE_TRACE_RING_SIZE
+ * events, the oldest ones being overwritten. The rings are dumped to
+ * a file on SIGUSR1, or when a command takes more than the slow
+ * request threshold; trace_convert.run turns the file into a Chrome
+ * trace (JSON) that Perfetto or chrome://tracing can open.
+ * Tracing is compiled in with -DBABBLE_TRACE (see Makefile); while it
+ * is disabled, each trace point costs a test of trace_enabled. */
+
+typedef enum{
+    TRACE_COMMAND_BEGIN = 0, /* arg: client key, arg2: command id */
+    TRACE_COMMAND_END,       /* arg: client key, arg2: command id */
+    TRACE_LOCK_WAIT,         /* arg: mutex, arg2: lock class */
+    TRACE_SOCKET_WRITE,      /* arg: client key, arg2: nb of bytes */
+    TRACE_FANOUT_CHUNK,      /* arg: publication seq, arg2: nb of timelines */
+    NB_TRACE_EVENTS
+} trace_event_type_t;
+
+/* events with a duration are recorded when they end, date being their
+ * start */
+typedef struct trace_event{
+    uint64_t date;     /* monotonic, in ns */
+    uint64_t duration; /* in ns, 0 for begin and end events */
+    uint64_t arg;
+    uint32_t arg2;
+    uint32_t type;
+} trace_event_t;
+
+/* layout of a dump: for each ring, a header followed by its events,
+ * from the oldest to the most recent */
+#define TRACE_DUMP_MAGIC 0x42424c5452414345ULL
+
+typedef struct trace_ring_header{
+    uint64_t magic;
+    uint64_t tid;       /* id of the thread that wrote the ring */
+    uint64_t nb_events;
+} trace_ring_header_t;
+
+/* enables tracing; commands lasting more than slow_ms ms trigger a
+ * dump (never if slow_ms is 0), as does SIGUSR1 */
+/* returns -1 if tracing is not compiled in */
+int trace_init(unsigned int slow_ms);
+
+#ifdef BABBLE_TRACE
+
+extern int trace_enabled;
+
+uint64_t trace_now(void);
+
+void trace_record(trace_event_type_t type, uint64_t date, uint64_t duration, uint64_t arg, uint32_t arg2);
+
+/* records an instant event */
+#define trace_event(type, arg, arg2)                                   \
+    do {                                                               \
+        if (__builtin_expect(trace_enabled, 0)) {                      \
+            trace_record((type), trace_now(), 0, (arg), (arg2));       \
+        }                                                              \
+    } while (0)
+
+/* start date of an event with a duration, recorded by trace_span() */
+#define trace_begin() (__builtin_expect(trace_enabled, 0) ? trace_now() : 0)
+
+#define trace_span(type, start, arg, arg2)                                      \
+    do {                                                                        \
+        if (__builtin_expect(trace_enabled, 0) && (start) != 0) {               \
+            trace_record((type), (start), trace_now() - (start), (arg), (arg2)); \
+        }                                                                       \
+    } while (0)
+
+/* dumps the rings if duration (ns) exceeds the slow request threshold */
+void trace_slow_request(uint64_t duration);
+
+/* called with the total duration of each command */
+#define trace_check_slow(duration)                      \
+    do {                                                \
+        if (__builtin_expect(trace_enabled, 0)) {       \
+            trace_slow_request(duration);               \
+        }                                               \
+    } while (0)
+
+#else
+
+#define trace_event(type, arg, arg2) do { } while (0)
+#define trace_begin() 0
+#define trace_span(type, start, arg, arg2) do { (void)(start); } while (0)
+#define trace_check_slow(duration) do { } while (0)
+
+#endif
+
+#endif
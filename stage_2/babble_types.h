@@ -2,10 +2,11 @@
 #define __BABBLE_TYPES_H__
 
 #include <time.h>
+#include <stdint.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "babble_config.h"
+#include "babble_followers.h"
 
 /* forward declaration, defined in babble_timeline.h */
 struct timeline;
@@ -17,9 +18,20 @@ typedef enum{
     TIMELINE,
     FOLLOW_COUNT,
     RDV,
-    UNREGISTER
+    UNREGISTER, /* internal, sent on disconnection */
+    STATS
 } command_id;
 
+/* steps of the life of a command, timestamped for the statistics */
+typedef enum{
+    STAMP_RECV = 0, /* request received */
+    STAMP_ENQUEUE,  /* parsed, waiting for room in cmd_buff */
+    STAMP_DEQUEUE,  /* taken by an executor */
+    STAMP_EXECUTED, /* answer ready */
+    STAMP_SENT,     /* answer written to the socket */
+    NB_STAMPS
+} command_stamp_t;
+
 typedef struct command{
     command_id cid;
     int sock;    /* only needed by the LOGIN command, other commands
@@ -27,24 +39,44 @@ typedef struct command{
     unsigned long key;
     char msg[BABBLE_PUBLICATION_SIZE];
     int answer_expected;   /* answer sent only if set */
+    unsigned long request_size; /* bytes received */
+    uint64_t dates[NB_STAMPS]; /* monotonic dates in ns */
 } command_t;
 
+/* the fields are grouped by writer, each group starting on its own
+ * cache line, so that commands of different clients running on
+ * different executors do not invalidate the lines read by publishers
+ * (see layout_test.c) */
 typedef struct client_bundle{
+    /* read-mostly, set at login */
     unsigned long key;     /* hash of the name */
-    char client_name[BABBLE_ID_SIZE];    /* name as provided by the
-                                          * client */
     int sock;              /* socket to communicate with this client */
-    struct timeline *timeline;   /* timeline of the client */
-    struct client_bundle *followers[MAX_CLIENT];  /* key of the followers */
-    unsigned int nb_followers;
     unsigned int disconnected; /* set to 1 when client has
                                 * disconnected */
-    pthread_mutex_t flock; // lock for followers list
-    int cmd_on_wait; // counter of cmds pending
-    pthread_mutex_t cmdlock; // to protect the counter
-    sem_t cmd_sem; 
-    
+    struct timeline *timeline;   /* timeline of the client */
+    struct timeline *outbox;     /* publications of the client (pull
+                                  * mode) */
+    char client_name[BABBLE_ID_SIZE];    /* name as provided by the
+                                          * client */
+    unsigned int prefix_len;
+    char prefix[BABBLE_ID_SIZE + 5];  /* "    <name>[" preformatted for
+                                       * replies and publications (see
+                                       * babble_format.h) */
+
+    /* written by each command of the client */
+    int cmd_on_wait BABBLE_CACHELINE_ALIGNED; // counter of cmds pending
+    babble_mutex_t cmdlock; // to protect the counter
+    pthread_cond_t cmd_cond; // signaled when cmd_on_wait drops to 0
+
+    /* written by the clients starting to follow this one */
+    follower_set_t followers;  /* clients following this client */
 
+    /* written by the FOLLOW and TIMELINE commands of the client */
+    follower_set_t following;  /* clients followed by this client, the
+                                * cursor of each entry is the nb of
+                                * publications of its outbox already
+                                * consumed */
+    babble_mutex_t following_lock; // lock for following list
 } client_bundle_t;
 
 
@@ -6,196 +6,198 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "babble_registration.h"
 #include "fastrand.h"
 
 
 /* Warning: delimiter can't be changed for now */
-#define BABBLE_DELIMITER " "
+#define BABBLE_DELIMITER ' '
 
+/* nb of tokens needed to parse a request: [S] command payload */
+#define BABBLE_MAX_TOKENS 3
 
-
-/* split the string according to BABBLE_DELIMITER */
-/* returns an array of char* with a copy of each item found */
-/* number of items is stored in nb_found */
-static char** split_string(char* str, int* nb_found)
+static int is_end_of_line(char c)
 {
-    int count=0;
-    int start=0;
-    int i=0;
+    return c == '\0' || c == '\r' || c == '\n';
+}
 
-    char **result=NULL;
-    
-    for(i=0; i< strlen(str); i++){
-        if(!strncmp(&str[i], BABBLE_DELIMITER, 1)){
-            if(i-start > 0){
-                count++;
-                result = realloc(result, sizeof(char*)*count);
-                char* new_item = malloc(sizeof(char*) * BABBLE_BUFFER_SIZE);
-                memset(new_item, 0, BABBLE_BUFFER_SIZE);
-                strncpy(new_item, &str[start], i-start);
-                result[count-1]=new_item;
-            }
-            start = i+1;
+/* returns the index of the first delimiter or end of line character
+ * in str[from, len), len if there is none */
+static size_t scan_token_end(const char *str, size_t from, size_t len)
+{
+#ifdef __SSE2__
+    /* 16 characters at a time, as long as they are in the buffer */
+    const __m128i delim = _mm_set1_epi8(BABBLE_DELIMITER);
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i nul = _mm_setzero_si128();
+    __m128i chunk, found;
+    int mask;
+
+    while(from + 16 <= len){
+        chunk = _mm_loadu_si128((const __m128i *)(str + from));
+        found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, delim), _mm_cmpeq_epi8(chunk, nul)),
+                             _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        mask = _mm_movemask_epi8(found);
+        if(mask){
+            return from + __builtin_ctz(mask);
         }
+        from += 16;
     }
+#endif
 
-    /* create final item */
-    if(strlen(str)-start > 0){
-        count++;
-        result = realloc(result, sizeof(char*)*count);
-        char* new_item = malloc(sizeof(char*) * BABBLE_BUFFER_SIZE);
-        memset(new_item, 0, BABBLE_BUFFER_SIZE);
-        strncpy(new_item, &str[start], strlen(str)-start);
-        result[count-1]=new_item;
+    while(from < len && str[from] != BABBLE_DELIMITER && !is_end_of_line(str[from])){
+        from++;
     }
-    
-    *nb_found = count;
-
-    return result;
+    return from;
 }
 
-/* free an array generated by split_string() */
-static void free_split_array(char** array, int size)
+/* splits the line of str[0, len) into at most nb_max tokens, without
+ * copying them; the end of line (\r, \n) is replaced by \0 */
+/* returns the nb of tokens found */
+static int split_line(char *str, size_t len, const char **tokens, int *token_lens, int nb_max)
 {
-    int i=0;
+    size_t pos=0, end=0;
+    int count=0;
+
+    while(pos < len){
+        if(str[pos] == BABBLE_DELIMITER){
+            pos++;
+            continue;
+        }
+        if(is_end_of_line(str[pos])){
+            str[pos] = '\0';
+            break;
+        }
 
-    for(i=0; i<size; i++){
-        free(array[i]);
+        end = scan_token_end(str, pos, len);
+        if(count < nb_max){
+            tokens[count] = &str[pos];
+            token_lens[count] = end - pos;
+            count++;
+        }
+        pos = end;
     }
 
-    free(array);
+    return count;
 }
 
+/* the keywords are indexed by their length, each length has a bucket
+ * of up to KEYWORD_BUCKET_SIZE keywords (LOGIN and STATS share one) */
+#define KEYWORD_BUCKET_SIZE 2
 
-unsigned long hash(char *str){
-    unsigned long hash = 5381;
-    int c;
-    
-    while ((c = *str++) != 0){
-        hash = ((hash << 5) + hash) + c;
-    }
-    
-    return hash;
-}
+typedef struct {
+    const char *word;
+    int cid;
+} keyword_t;
 
-int str_to_command(char* str, int* ack_req)
-{
-    int nb_items=0;
-    char** items=split_string(str, &nb_items);
+static const keyword_t keywords[][KEYWORD_BUCKET_SIZE] = {
+    [3] = {{"RDV", RDV}},
+    [5] = {{"LOGIN", LOGIN}, {"STATS", STATS}},
+    [6] = {{"FOLLOW", FOLLOW}},
+    [7] = {{"PUBLISH", PUBLISH}},
+    [8] = {{"TIMELINE", TIMELINE}},
+    [12] = {{"FOLLOW_COUNT", FOLLOW_COUNT}},
+};
 
-    int cid_index=0;
+#define NB_KEYWORD_SLOTS (sizeof(keywords) / sizeof(keywords[0]))
 
-    
-    if(nb_items == 0){
-        fprintf(stderr,"Error -- invalid request -> %s\n", str);
+static int keyword_to_command(const char *token, int len)
+{
+    int i = 0;
+
+    if(len >= NB_KEYWORD_SLOTS){
         return -1;
     }
-    
-    if(strlen(items[0]) == 1 && items[0][0] == 'S'){
-        *ack_req=0;
-        cid_index=1;
+    for(i = 0; i < KEYWORD_BUCKET_SIZE && keywords[len][i].word != NULL; i++){
+        if(!memcmp(token, keywords[len][i].word, len)){
+            return keywords[len][i].cid;
+        }
     }
-    else{
-        *ack_req=1;
-    }    
- 
-    
-    if(strlen(items[cid_index]) == 1){
-        errno=0;
-        int res = (int)strtol(items[cid_index], NULL, 10);
+    return -1;
+}
 
-        if(errno || (res == 0 && *items[cid_index]!='0')){
-            //fprintf(stderr,"Error -- invalid request -> %s\n", str);
-            free_split_array(items, nb_items);
+static int token_to_command(const char *token, int len, int ack_req)
+{
+    int res = -1;
+
+    if(len == 1){
+        /* numerical command id */
+        if(token[0] < '0' || token[0] > '9'){
             return -1;
         }
-        
-        
-        if( res < LOGIN || res > RDV){
-            //fprintf(stderr,"Error -- invalid request -> %s\n", str);
-            free_split_array(items, nb_items);
+        res = token[0] - '0';
+
+        /* UNREGISTER is internal to the server */
+        if( res < LOGIN || res > STATS || res == UNREGISTER){
             return -1;
         }
 
-        if(res == LOGIN || res == TIMELINE || res == FOLLOW_COUNT || res == RDV){
-            if(*ack_req == 0){
-                //fprintf(stderr,"Error -- invalid request -> %s\n", str);
-                free_split_array(items, nb_items);
+        if(res == LOGIN || res == TIMELINE || res == FOLLOW_COUNT || res == RDV || res == STATS){
+            if(ack_req == 0){
                 return -1;
             }
         }
-
-        free_split_array(items, nb_items);
         return res;
     }
-    
-    if(!strcmp(items[cid_index], "LOGIN")){
-        free_split_array(items, nb_items);
-        if(*ack_req == 0){
-            //fprintf(stderr,"Error -- invalid request -> %s\n", str);
+
+    res = keyword_to_command(token, len);
+
+    if(res == LOGIN || res == TIMELINE || res == FOLLOW_COUNT || res == STATS){
+        if(ack_req == 0){
             return -1;
         }
-        return LOGIN;
     }
+    return res;
+}
 
-    if(!strcmp(items[cid_index], "PUBLISH")){
-        free_split_array(items, nb_items);
-        return PUBLISH;
-    }
+int parse_request(char *str, size_t len, parsed_request_t *req)
+{
+    const char *tokens[BABBLE_MAX_TOKENS];
+    int token_lens[BABBLE_MAX_TOKENS];
+    int nb_tokens = split_line(str, len, tokens, token_lens, BABBLE_MAX_TOKENS);
+    int cid_index=0;
+
+    req->cid = -1;
+    req->ack_req = 1;
+    req->payload = NULL;
+    req->payload_len = 0;
 
-    if(!strcmp(items[cid_index], "FOLLOW")){
-        free_split_array(items, nb_items);
-        return FOLLOW;
+    if(nb_tokens == 0){
+        fprintf(stderr,"Error -- invalid request -> %s\n", str);
+        return -1;
     }
 
-    if(!strcmp(items[cid_index], "TIMELINE")){
-        free_split_array(items, nb_items);
-        if(*ack_req == 0){
-            //fprintf(stderr,"Error -- invalid request -> %s\n", str);
-            return -1;
-        }
-        return TIMELINE;
+    if(token_lens[0] == 1 && tokens[0][0] == 'S'){
+        req->ack_req=0;
+        cid_index=1;
     }
 
-    if(!strcmp(items[cid_index], "FOLLOW_COUNT")){
-        free_split_array(items, nb_items);
-        if(*ack_req == 0){
-            //fprintf(stderr,"Error -- invalid request -> %s\n", str);
-            return -1;
-        }
-        return FOLLOW_COUNT;
+    if(nb_tokens <= cid_index){
+        return -1;
     }
 
-    if(!strcmp(items[cid_index], "RDV")){
-        free_split_array(items, nb_items);
-        return RDV;
+    req->cid = token_to_command(tokens[cid_index], token_lens[cid_index], req->ack_req);
+
+    if(nb_tokens > cid_index + 1){
+        req->payload = tokens[cid_index + 1];
+        req->payload_len = token_lens[cid_index + 1];
     }
 
-    free_split_array(items, nb_items);
-    
-    return -1;
+    return req->cid;
 }
 
-int str_to_payload(char* input, char* output, int size)
+int request_payload(parsed_request_t *req, char *output, int size)
 {
-    int nb_items=0;
-    char **items=split_string(input, &nb_items);
-    
-    int p_index=1;
+    int payload_size = req->payload_len;
 
-    if(strlen(items[0]) == 1 && items[0][0] == 'S'){
-        p_index=2;
-    }
-    
-    if(nb_items <= p_index){
-        fprintf(stderr,"Error -- invalid payload -> %s\n", input);
-        free_split_array(items, nb_items);
+    if(req->payload == NULL){
         return -1;
-    }    
-    
-    int payload_size = strlen(items[p_index]);
+    }
 
     if(payload_size > size){
         payload_size = size;
@@ -203,25 +205,49 @@ int str_to_payload(char* input, char* output, int size)
     }
 
     memset(output, 0, size);
-    strncpy(output, items[p_index], payload_size);
+    memcpy(output, req->payload, payload_size);
 
-    free_split_array(items, nb_items);
+    return 0;
+}
+
+unsigned long hash(char *str){
+    unsigned long hash = 5381;
+    int c;
     
+    while ((c = *str++) != 0){
+        hash = ((hash << 5) + hash) + c;
+    }
+    
+    return hash;
+}
+
+int str_to_command(char* str, int* ack_req)
+{
+    parsed_request_t req;
+    int res = parse_request(str, strlen(str), &req);
+
+    *ack_req = req.ack_req;
+    return res;
+}
+
+int str_to_payload(char* input, char* output, int size)
+{
+    parsed_request_t req;
+
+    parse_request(input, strlen(input), &req);
+
+    if(request_payload(&req, output, size)){
+        fprintf(stderr,"Error -- invalid payload -> %s\n", input);
+        return -1;
+    }
+
     return 0;
 }
 
 /* cut str to \r or \n*/
 void str_clean(char* str)
 {
-    char* found= strstr(str, "\r");
-    if(found){
-        *found='\0';
-    }
-
-    found= strstr(str, "\n");
-    if(found){
-        *found='\0';
-    }
+    str[strcspn(str, "\r\n")] = '\0';
 }
 
 unsigned long parse_login_ack(char* ack_msg)
@@ -1,12 +1,31 @@
 #ifndef __BABBLE_UTILS_H__
 #define __BABBLE_UTILS_H__
 
+#include <stddef.h>
+
 /* djb2 hash function */
 unsigned long hash(char *str);
 
 /* truncate input string at first line feed (\n), and remove \n */
 void str_clean(char* str);
 
+/* a request parsed in place: the payload points into the input */
+typedef struct parsed_request{
+    int cid; /* command id, -1 if the request is invalid */
+    int ack_req; /* set if an answer is expected */
+    const char *payload; /* NULL if there is no payload */
+    int payload_len;
+} parsed_request_t;
+
+/* parses the request stored in str[0, len) in a single pass, without
+ * allocating; the request ends at the first \r, \n or \0 (which is
+ * replaced by \0) */
+/* returns the command id, -1 if the request is invalid */
+int parse_request(char *str, size_t len, parsed_request_t *req);
+
+/* copy the payload of req into output (copy at most size characters) */
+int request_payload(parsed_request_t *req, char *output, int size);
+
 /* convert input string to babble command id */
 int str_to_command(char* str, int* ack_req);
 
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "babble_types.h"
+#include "babble_communication.h"
+#include "babble_utils.h"
+#include "babble_client.h"
+#include "babble_histogram.h"
+
+/* open-loop latency test: each client publishes on a fixed schedule,
+ * whatever the answers, and the latency of a request is measured from
+ * the date it was scheduled at, not from the date it was sent, so that
+ * the time spent waiting for a saturated server is not omitted. The
+ * test is repeated for each target rate, with new clients. */
+
+/* max nb of requests of a client waiting for an answer */
+#define LATENCY_WINDOW 65536
+
+/* time given to the server to answer after the last request, in ms */
+#define LATENCY_DRAIN 5000
+
+typedef struct client_thread_data{
+    int client_id;
+    uint64_t start;  /* date of the first request */
+    uint64_t period; /* between two requests of the client, in ns */
+    int sockfd;
+
+    /* written by the sender */
+    uint64_t intended[LATENCY_WINDOW]; /* date of request seq, modulo the
+                                        * window, 0 once answered */
+    unsigned long nb_sent;
+    int sender_done;
+
+    /* written by the receiver */
+    unsigned long nb_answered;
+    unsigned long nb_unanswered;
+    histogram_t latencies; /* in ns */
+} client_thread_data_t;
+
+char hostname[BABBLE_BUFFER_SIZE]="127.0.0.1";
+int portno = BABBLE_PORT;
+
+/* duration of each step in seconds */
+int duration = 2;
+
+int nb_clients = 4;
+
+static const char *default_rates = "1000,2000,5000,10000,20000,50000";
+
+
+static void display_help(char *exec)
+{
+    printf("Usage: %s -m hostname -p port_number -n nb_clients -d duration -r rates\n", exec);
+    printf("\t hostname can be an ip address\n" );
+    printf("\t rates is a comma separated list of target rates (requests/s of all clients, default %s)\n", default_rates);
+    printf("\t each rate is tested during duration seconds\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return (uint64_t)tt.tv_sec * 1000000000ULL + tt.tv_nsec;
+}
+
+static void sleep_until(uint64_t date)
+{
+    struct timespec tt;
+
+    tt.tv_sec = date / 1000000000ULL;
+    tt.tv_nsec = date % 1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tt, NULL) != 0)
+        ;
+}
+
+/* requests are sent while the previous ones are not acknowledged:
+ * with Nagle's algorithm, they would wait for the ACKs, which the
+ * server delays */
+static void set_nodelay(int sockfd)
+{
+    int one = 1;
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* returns the seq of the publication acknowledged by answer, -1 if
+ * there is none */
+static long answer_seq(char *answer)
+{
+    char *p = strstr(answer, "{ lat_");
+
+    return (p == NULL)? -1 : strtol(p + 6, NULL, 10);
+}
+
+/* sends the requests of the client at their scheduled dates */
+static void *sender_thread(void *arg)
+{
+    client_thread_data_t *data= (client_thread_data_t*) arg;
+    uint64_t end = data->start + (uint64_t)duration * 1000000000ULL;
+    uint64_t intended = data->start;
+    char buffer[BABBLE_BUFFER_SIZE];
+    unsigned long seq = 0, size = 0;
+
+    for(seq = 0; intended < end; seq++, intended += data->period){
+        /* late requests are sent at once: their latency includes the
+         * delay */
+        sleep_until(intended);
+
+        /* too many requests waiting: the latency grows meanwhile */
+        while(seq - __atomic_load_n(&data->nb_answered, __ATOMIC_ACQUIRE) >= LATENCY_WINDOW){
+            usleep(100);
+        }
+
+        data->intended[seq % LATENCY_WINDOW] = intended;
+        __atomic_store_n(&data->nb_sent, seq + 1, __ATOMIC_RELEASE);
+
+        /* the size and the request are sent in a single write, a
+         * single segment */
+        size = snprintf(buffer + sizeof(unsigned long), BABBLE_BUFFER_SIZE - sizeof(unsigned long),
+                        "%d lat_%lu\n", PUBLISH, seq) + 1;
+        memcpy(buffer, &size, sizeof(unsigned long));
+        if(network_send_raw(data->sockfd, sizeof(unsigned long) + size, buffer) == -1){
+            fprintf(stderr,"client %d failed to send request %lu\n", data->client_id, seq);
+            break;
+        }
+    }
+
+    __atomic_store_n(&data->sender_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* receives the answers, until all requests are answered or the drain
+ * delay is over */
+static void *receiver_thread(void *arg)
+{
+    client_thread_data_t *data= (client_thread_data_t*) arg;
+    uint64_t deadline = data->start + (uint64_t)duration * 1000000000ULL + LATENCY_DRAIN * 1000000ULL;
+    struct pollfd pfd = {data->sockfd, POLLIN, 0};
+    unsigned long nb_sent = 0, seq = 0;
+    char *answer = NULL;
+    long answered = 0;
+
+    while(now_ns() < deadline){
+        nb_sent = __atomic_load_n(&data->nb_sent, __ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&data->sender_done, __ATOMIC_ACQUIRE) && data->nb_answered == nb_sent){
+            break;
+        }
+
+        if(poll(&pfd, 1, 100) != 1){
+            continue;
+        }
+        if((answer = recv_one_msg(data->sockfd)) == NULL){
+            break;
+        }
+
+        /* executors may answer the requests of a client out of order */
+        answered = answer_seq(answer);
+        free(answer);
+        if(answered < 0 || (unsigned long)answered >= __atomic_load_n(&data->nb_sent, __ATOMIC_ACQUIRE)){
+            fprintf(stderr,"client %d received an unexpected answer\n", data->client_id);
+            continue;
+        }
+
+        histogram_record(&data->latencies, now_ns() - data->intended[answered % LATENCY_WINDOW]);
+        data->intended[answered % LATENCY_WINDOW] = 0;
+        __atomic_store_n(&data->nb_answered, data->nb_answered + 1, __ATOMIC_RELEASE);
+    }
+
+    /* requests never answered are accounted as answered now */
+    nb_sent = __atomic_load_n(&data->nb_sent, __ATOMIC_ACQUIRE);
+    for(seq = (nb_sent > LATENCY_WINDOW)? nb_sent - LATENCY_WINDOW : 0; seq < nb_sent; seq++){
+        if(data->intended[seq % LATENCY_WINDOW] != 0){
+            histogram_record(&data->latencies, now_ns() - data->intended[seq % LATENCY_WINDOW]);
+            data->nb_unanswered++;
+        }
+    }
+
+    return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+    client_thread_data_t *data= (client_thread_data_t*) arg;
+    pthread_t sender, receiver;
+
+    pthread_create(&sender, NULL, sender_thread, data);
+    pthread_create(&receiver, NULL, receiver_thread, data);
+    pthread_join(sender, NULL);
+    pthread_join(receiver, NULL);
+
+    close(data->sockfd);
+    return NULL;
+}
+
+/* runs the test at rate requests/s; returns -1 on failure */
+static int run_step(int step, double rate)
+{
+    client_thread_data_t *clients_data = calloc(nb_clients, sizeof(client_thread_data_t));
+    pthread_t *tids = malloc(nb_clients * sizeof(pthread_t));
+    uint64_t period = (uint64_t)(1e9 * nb_clients / rate);
+    char client_name[BABBLE_ID_SIZE];
+    unsigned long nb_sent = 0, nb_unanswered = 0;
+    histogram_t h;
+    uint64_t start;
+    int i = 0;
+
+    /* the clients are logged in before the schedule starts */
+    for(i = 0; i < nb_clients; i++){
+        snprintf(client_name, BABBLE_ID_SIZE, "lat_%d_%d", step, i);
+        clients_data[i].client_id = i;
+        clients_data[i].period = period;
+        histogram_init(&clients_data[i].latencies);
+
+        if((clients_data[i].sockfd = connect_to_server(hostname, portno)) == -1
+           || client_login(clients_data[i].sockfd, client_name) == 0){
+            fprintf(stderr,"*** Test Failed ***\n");
+            fprintf(stderr,"client %s failed to login\n", client_name);
+            return -1;
+        }
+        set_nodelay(clients_data[i].sockfd);
+    }
+
+    /* the requests of the clients are evenly spread */
+    start = now_ns() + 10000000;
+    for(i = 0; i < nb_clients; i++){
+        clients_data[i].start = start + i * period / nb_clients;
+        pthread_create(&tids[i], NULL, client_thread, &clients_data[i]);
+    }
+
+    histogram_init(&h);
+    for(i = 0; i < nb_clients; i++){
+        pthread_join(tids[i], NULL);
+        histogram_add(&h, &clients_data[i].latencies);
+        nb_sent += clients_data[i].nb_sent;
+        nb_unanswered += clients_data[i].nb_unanswered;
+    }
+
+    printf("%10.0lf %10.0lf %10.1lf %10.1lf %10.1lf %10.1lf %10.1lf %10lu\n",
+           rate, (double)nb_sent / duration,
+           histogram_percentile(&h, 50.0) / 1000.0,
+           histogram_percentile(&h, 90.0) / 1000.0,
+           histogram_percentile(&h, 99.0) / 1000.0,
+           histogram_percentile(&h, 99.9) / 1000.0,
+           histogram_max(&h) / 1000.0,
+           nb_unanswered);
+    fflush(stdout);
+
+    free(tids);
+    free(clients_data);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int nb_args=1;
+    char rates[BABBLE_BUFFER_SIZE];
+    char *rate = NULL, *saveptr = NULL;
+    int step = 0;
+
+    strncpy(rates, default_rates, BABBLE_BUFFER_SIZE);
+
+    /* parsing command options */
+    while ((opt = getopt (argc, argv, "+hm:p:n:d:r:")) != -1){
+        switch (opt){
+        case 'm':
+            strncpy(hostname,optarg,BABBLE_BUFFER_SIZE);
+            nb_args+=2;
+            break;
+        case 'p':
+            portno = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'n':
+            nb_clients = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'r':
+            strncpy(rates, optarg, BABBLE_BUFFER_SIZE - 1);
+            nb_args+=2;
+            break;
+        case 'h':
+        case '?':
+        default:
+            display_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(nb_args != argc || nb_clients <= 0 || duration <= 0){
+        display_help(argv[0]);
+        return -1;
+    }
+
+    printf("open-loop latency test with %d clients, %d seconds per rate\n", nb_clients, duration);
+    printf("latencies in us, from the scheduled date of each request\n");
+    printf("%10s %10s %10s %10s %10s %10s %10s %10s\n",
+           "rate/s", "sent/s", "p50", "p90", "p99", "p99.9", "max", "unanswered");
+
+    for(rate = strtok_r(rates, ",", &saveptr); rate != NULL; rate = strtok_r(NULL, ",", &saveptr), step++){
+        if(atof(rate) <= 0){
+            display_help(argv[0]);
+            return -1;
+        }
+        if(run_step(step, atof(rate))){
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "babble_types.h"
+
+/* prints the layout of client_bundle_t, and measures the false sharing
+ * between the threads running the commands of a client and the
+ * threads publishing to it, compared to the previous packed layout */
+
+/* client_bundle_t before the fields were grouped by writer */
+typedef struct packed_follower_set{
+    follower_entry_t inline_items[BABBLE_FOLLOWERS_INLINE];
+    follower_table_t *table;
+    unsigned int nb_used;
+    unsigned int size;
+    pthread_mutex_t resize_lock;
+} packed_follower_set_t;
+
+typedef struct packed_client_bundle{
+    unsigned long key;
+    char client_name[BABBLE_ID_SIZE];
+    int sock;
+    struct timeline *timeline;
+    struct timeline *outbox;
+    packed_follower_set_t followers;
+    packed_follower_set_t following;
+    unsigned int disconnected;
+    pthread_mutex_t following_lock;
+    int cmd_on_wait;
+    pthread_mutex_t cmdlock;
+    pthread_cond_t cmd_cond;
+} packed_client_bundle_t;
+
+/* location of the fields used by the benchmark */
+typedef struct bundle_layout{
+    const char *name;
+    size_t size;
+    size_t timeline; /* read by publishers */
+    size_t table; /* read by publishers (followers) */
+    size_t fsize; /* written by FOLLOW (followers) */
+    size_t cmd_on_wait; /* written by each command */
+    size_t cmdlock;
+} bundle_layout_t;
+
+#define LAYOUT(type, set_type) { #type, sizeof(type),                   \
+            offsetof(type, timeline),                                   \
+            offsetof(type, followers) + offsetof(set_type, table),      \
+            offsetof(type, followers) + offsetof(set_type, size),       \
+            offsetof(type, cmd_on_wait), offsetof(type, cmdlock) }
+
+static bundle_layout_t layouts[] = {
+    LAYOUT(packed_client_bundle_t, packed_follower_set_t),
+    LAYOUT(client_bundle_t, follower_set_t),
+};
+
+#define NB_LAYOUTS (sizeof(layouts) / sizeof(layouts[0]))
+
+/* duration of each run in seconds */
+int duration = 1;
+
+int nb_readers = 2;
+int nb_writers = 2;
+
+volatile int keep_on_going = 1;
+
+/* keeps the reads of the readers from being optimized out */
+volatile uintptr_t reader_sink = 0;
+
+typedef struct bench_thread_data{
+    char *bundle;
+    bundle_layout_t *layout;
+    unsigned long nb_ops;
+} bench_thread_data_t;
+
+static void ALRMhandler (int sig)
+{
+    keep_on_going = 0;
+}
+
+static void display_help(char *exec)
+{
+    printf("Usage: %s -d duration -r nb_readers -w nb_writers\n", exec);
+    printf("\t readers act as publishers (read the timeline and the followers of a client)\n");
+    printf("\t writers act as commands of the client (pending counter) and new followers\n");
+}
+
+/**** pahole-style report ****/
+
+static size_t report_offset = 0;
+
+static void report_field(const char *name, size_t offset, size_t size)
+{
+    if (offset > report_offset)
+    {
+        printf("\t/* XXX %zu bytes hole */\n", offset - report_offset);
+    }
+    if (offset > 0 && offset % BABBLE_CACHELINE_SIZE == 0)
+    {
+        printf("\t/* --- cacheline %zu boundary (%zu bytes) --- */\n", offset / BABBLE_CACHELINE_SIZE, offset);
+    }
+    printf("\t%-20s /* %5zu %5zu */\n", name, offset, size);
+    report_offset = offset + size;
+}
+
+#define FIELD(type, field) report_field(#field, offsetof(type, field), sizeof(((type *)0)->field))
+
+static void report_client_bundle(void)
+{
+    report_offset = 0;
+    printf("struct client_bundle {\n");
+    FIELD(client_bundle_t, key);
+    FIELD(client_bundle_t, sock);
+    FIELD(client_bundle_t, disconnected);
+    FIELD(client_bundle_t, timeline);
+    FIELD(client_bundle_t, outbox);
+    FIELD(client_bundle_t, client_name);
+    FIELD(client_bundle_t, prefix_len);
+    FIELD(client_bundle_t, prefix);
+    FIELD(client_bundle_t, cmd_on_wait);
+    FIELD(client_bundle_t, cmdlock);
+    FIELD(client_bundle_t, cmd_cond);
+    FIELD(client_bundle_t, followers);
+    FIELD(client_bundle_t, following);
+    FIELD(client_bundle_t, following_lock);
+    if (sizeof(client_bundle_t) > report_offset)
+    {
+        printf("\t/* XXX %zu bytes padding */\n", sizeof(client_bundle_t) - report_offset);
+    }
+    printf("\t/* size: %zu, cachelines: %zu */\n};\n\n",
+           sizeof(client_bundle_t), (sizeof(client_bundle_t) + BABBLE_CACHELINE_SIZE - 1) / BABBLE_CACHELINE_SIZE);
+
+    report_offset = 0;
+    printf("struct follower_set {\n");
+    FIELD(follower_set_t, inline_items);
+    FIELD(follower_set_t, table);
+    FIELD(follower_set_t, nb_used);
+    FIELD(follower_set_t, size);
+    FIELD(follower_set_t, resize_lock);
+    printf("\t/* size: %zu, cachelines: %zu */\n};\n\n",
+           sizeof(follower_set_t), (sizeof(follower_set_t) + BABBLE_CACHELINE_SIZE - 1) / BABBLE_CACHELINE_SIZE);
+}
+
+/**** false sharing benchmark ****/
+
+static void *reader_thread(void *arg)
+{
+    bench_thread_data_t *data = arg;
+    void * volatile *timeline = (void * volatile *)(data->bundle + data->layout->timeline);
+    void * volatile *table = (void * volatile *)(data->bundle + data->layout->table);
+    unsigned long n = 0;
+    uintptr_t sum = 0;
+
+    while (keep_on_going)
+    {
+        sum += (uintptr_t)*timeline + (uintptr_t)*table;
+        n++;
+    }
+
+    reader_sink = sum;
+    data->nb_ops = n;
+    return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+    bench_thread_data_t *data = arg;
+    pthread_mutex_t *cmdlock = (pthread_mutex_t *)(data->bundle + data->layout->cmdlock);
+    int *cmd_on_wait = (int *)(data->bundle + data->layout->cmd_on_wait);
+    unsigned int *fsize = (unsigned int *)(data->bundle + data->layout->fsize);
+    unsigned long n = 0;
+
+    while (keep_on_going)
+    {
+        /* same accesses as client_cmd_begin() and follower_set_add() */
+        pthread_mutex_lock(cmdlock);
+        (*cmd_on_wait)++;
+        pthread_mutex_unlock(cmdlock);
+        __atomic_fetch_add(fsize, 1, __ATOMIC_ACQ_REL);
+        n++;
+    }
+
+    data->nb_ops = n;
+    return NULL;
+}
+
+static void run_benchmark(bundle_layout_t *layout)
+{
+    int nb_threads = nb_readers + nb_writers;
+    pthread_t *tids = malloc(sizeof(pthread_t) * nb_threads);
+    bench_thread_data_t *data = malloc(sizeof(bench_thread_data_t) * nb_threads);
+    unsigned long reads = 0, writes = 0;
+    char *bundle = NULL;
+    int i = 0;
+
+    if (posix_memalign((void **)&bundle, BABBLE_CACHELINE_SIZE, layout->size))
+    {
+        perror("posix_memalign");
+        exit(-1);
+    }
+    memset(bundle, 0, layout->size);
+    pthread_mutex_init((pthread_mutex_t *)(bundle + layout->cmdlock), NULL);
+
+    keep_on_going = 1;
+    alarm(duration);
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        data[i].bundle = bundle;
+        data[i].layout = layout;
+        data[i].nb_ops = 0;
+        pthread_create(&tids[i], NULL, (i < nb_readers) ? reader_thread : writer_thread, &data[i]);
+    }
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        if (i < nb_readers)
+        {
+            reads += data[i].nb_ops;
+        }
+        else
+        {
+            writes += data[i].nb_ops;
+        }
+    }
+
+    printf("%-24s size %5zu: reads %10.2lf Mops/s, writes %8.2lf Mops/s\n", layout->name, layout->size,
+           (double)reads / duration / 1e6, (double)writes / duration / 1e6);
+
+    pthread_mutex_destroy((pthread_mutex_t *)(bundle + layout->cmdlock));
+    free(bundle);
+    free(data);
+    free(tids);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int i = 0;
+
+    signal(SIGALRM, ALRMhandler);
+
+    while ((opt = getopt(argc, argv, "hd:r:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'r':
+            nb_readers = atoi(optarg);
+            break;
+        case 'w':
+            nb_writers = atoi(optarg);
+            break;
+        case 'h':
+        case '?':
+        default:
+            display_help(argv[0]);
+            return -1;
+        }
+    }
+
+    report_client_bundle();
+
+    printf("false sharing test: %d readers, %d writers, %d s per layout\n", nb_readers, nb_writers, duration);
+    for (i = 0; i < NB_LAYOUTS; i++)
+    {
+        run_benchmark(&layouts[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "babble_types.h"
+#include "babble_trace.h"
+#include "babble_lock.h"
+
+/* converts a dump of the flight recorder of the server (see
+ * babble_trace.h) into a Chrome trace, readable by Perfetto or
+ * chrome://tracing */
+
+static const char *command_names[] = {
+    "LOGIN", "PUBLISH", "FOLLOW", "TIMELINE", "FOLLOW_COUNT", "RDV",
+    "UNREGISTER", "STATS"};
+
+#define NB_COMMAND_NAMES (sizeof(command_names) / sizeof(command_names[0]))
+
+static const char *lock_class_names[NB_LOCK_CLASSES] = LOCK_CLASS_NAMES;
+
+typedef struct ring{
+    trace_ring_header_t header;
+    trace_event_t *events;
+} ring_t;
+
+static void display_help(char *exec)
+{
+    printf("Usage: %s trace_file [json_file]\n", exec);
+    printf("\t writes the trace to stdout if json_file is not given\n");
+}
+
+static const char *command_name(uint32_t cid)
+{
+    return (cid < NB_COMMAND_NAMES) ? command_names[cid] : "UNKNOWN";
+}
+
+/* writes the fields shared by all events, ts in us since origin */
+static void write_common(FILE *out, ring_t *ring, trace_event_t *e, uint64_t origin)
+{
+    fprintf(out, "\"pid\":1,\"tid\":%" PRIu64 ",\"ts\":%.3f",
+            ring->header.tid, (e->date - origin) / 1000.0);
+}
+
+/* returns 0 if e has to be skipped: the begin event of a command may
+ * have been overwritten before its end */
+static int keep_event(trace_event_t *e, int *in_command)
+{
+    switch (e->type)
+    {
+    case TRACE_COMMAND_BEGIN:
+        *in_command = 1;
+        return 1;
+    case TRACE_COMMAND_END:
+        if (!*in_command)
+        {
+            return 0;
+        }
+        *in_command = 0;
+        return 1;
+    default:
+        return e->type < NB_TRACE_EVENTS;
+    }
+}
+
+static void write_event(FILE *out, ring_t *ring, trace_event_t *e, uint64_t origin)
+{
+    switch (e->type)
+    {
+    case TRACE_COMMAND_BEGIN:
+        fprintf(out, "{\"name\":\"%s\",\"cat\":\"command\",\"ph\":\"B\",", command_name(e->arg2));
+        write_common(out, ring, e, origin);
+        fprintf(out, ",\"args\":{\"key\":%" PRIu64 "}}", e->arg);
+        break;
+    case TRACE_COMMAND_END:
+        fprintf(out, "{\"name\":\"%s\",\"cat\":\"command\",\"ph\":\"E\",", command_name(e->arg2));
+        write_common(out, ring, e, origin);
+        fprintf(out, "}");
+        break;
+    case TRACE_LOCK_WAIT:
+        fprintf(out, "{\"name\":\"wait %s\",\"cat\":\"lock\",\"ph\":\"X\",",
+                (e->arg2 < NB_LOCK_CLASSES) ? lock_class_names[e->arg2] : "lock");
+        write_common(out, ring, e, origin);
+        fprintf(out, ",\"dur\":%.3f,\"args\":{\"mutex\":\"0x%" PRIx64 "\"}}", e->duration / 1000.0, e->arg);
+        break;
+    case TRACE_SOCKET_WRITE:
+        fprintf(out, "{\"name\":\"socket write\",\"cat\":\"io\",\"ph\":\"X\",");
+        write_common(out, ring, e, origin);
+        fprintf(out, ",\"dur\":%.3f,\"args\":{\"key\":%" PRIu64 ",\"bytes\":%u}}",
+                e->duration / 1000.0, e->arg, e->arg2);
+        break;
+    case TRACE_FANOUT_CHUNK:
+        fprintf(out, "{\"name\":\"fanout chunk\",\"cat\":\"fanout\",\"ph\":\"X\",");
+        write_common(out, ring, e, origin);
+        fprintf(out, ",\"dur\":%.3f,\"args\":{\"seq\":%" PRIu64 ",\"timelines\":%u}}",
+                e->duration / 1000.0, e->arg, e->arg2);
+        break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in = NULL;
+    FILE *out = stdout;
+    ring_t *rings = NULL;
+    int nb_rings = 0;
+    trace_ring_header_t header;
+    uint64_t origin = UINT64_MAX;
+    unsigned long nb_events = 0, i = 0;
+    int r = 0, first = 1, in_command = 0;
+
+    if (argc < 2 || argc > 3)
+    {
+        display_help(argv[0]);
+        return -1;
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL)
+    {
+        perror("opening trace file");
+        return -1;
+    }
+
+    while (fread(&header, sizeof(header), 1, in) == 1)
+    {
+        if (header.magic != TRACE_DUMP_MAGIC)
+        {
+            fprintf(stderr, "Error -- %s is not a trace file\n", argv[1]);
+            return -1;
+        }
+
+        rings = realloc(rings, (nb_rings + 1) * sizeof(ring_t));
+        rings[nb_rings].header = header;
+        rings[nb_rings].events = malloc(header.nb_events * sizeof(trace_event_t) + 1);
+        if (fread(rings[nb_rings].events, sizeof(trace_event_t), header.nb_events, in) != header.nb_events)
+        {
+            fprintf(stderr, "Error -- truncated trace file %s\n", argv[1]);
+            return -1;
+        }
+
+        for (i = 0; i < header.nb_events; i++)
+        {
+            if (rings[nb_rings].events[i].date < origin)
+            {
+                origin = rings[nb_rings].events[i].date;
+            }
+        }
+        nb_rings++;
+    }
+    fclose(in);
+
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL)
+    {
+        perror("opening json file");
+        return -1;
+    }
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    for (r = 0; r < nb_rings; r++)
+    {
+        in_command = 0;
+        for (i = 0; i < rings[r].header.nb_events; i++)
+        {
+            if (!keep_event(&rings[r].events[i], &in_command))
+            {
+                continue;
+            }
+            if (!first)
+            {
+                fprintf(out, ",\n");
+            }
+            write_event(out, &rings[r], &rings[r].events[i], origin);
+            first = 0;
+            nb_events++;
+        }
+        free(rings[r].events);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    free(rings);
+
+    fprintf(stderr, "%lu events of %d threads converted\n", nb_events, nb_rings);
+
+    return 0;
+}
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "babble_types.h"
+#include "babble_communication.h"
+#include "babble_utils.h"
+#include "babble_client.h"
+#include "babble_histogram.h"
+#include "fastrand.h"
+
+/* mixed workload: the clients follow each other along a power-law
+ * graph and worker threads issue PUBLISH, TIMELINE, FOLLOW and
+ * FOLLOW_COUNT requests in configurable ratios, on behalf of clients
+ * drawn with a skewed popularity. Client i has popularity rank i:
+ * client 0 is the most followed and publishes the most, so the
+ * fan-out and the locks of the server see the skew of a real graph.
+ * Each operation is closed-loop; its latency is measured once the
+ * worker owns the connection of the client. */
+
+typedef enum{
+    OP_PUBLISH = 0,
+    OP_TIMELINE,
+    OP_FOLLOW,
+    OP_FOLLOW_COUNT,
+    NB_OPS
+} op_t;
+
+static const char *op_names[NB_OPS] = {"publish", "timeline", "follow", "follow_count"};
+
+/* a connection carries one request at a time */
+typedef struct client{
+    int sockfd;
+    pthread_mutex_t lock;
+    char name[BABBLE_ID_SIZE];
+} client_t;
+
+typedef struct worker_data{
+    int worker_id;
+    unsigned long nb_ops[NB_OPS];
+    histogram_t latencies[NB_OPS]; /* in ns */
+} worker_data_t;
+
+/* busy clients are drawn again this nb of times before waiting for
+ * the last one drawn, so that the workers do not all queue behind the
+ * most popular clients */
+#define WORKLOAD_REDRAWS 4
+
+char hostname[BABBLE_BUFFER_SIZE]="127.0.0.1";
+int portno = BABBLE_PORT;
+
+/* duration of the test in seconds */
+int duration = 5;
+
+int nb_clients = 100;
+int nb_workers = 8;
+
+/* exponent of the popularity (1 is the classic Zipf law, 0 is uniform) */
+double zipf_s = 1.0;
+
+/* mean nb of clients followed by a client */
+int mean_follows = 10;
+
+/* ratios of the operations, in % */
+int mix[NB_OPS] = {30, 60, 5, 5};
+
+/* set to display the statistics of the server */
+int with_stats = 0;
+
+/* reset to stop the test */
+volatile int keep_on_going = 1;
+
+client_t *clients = NULL;
+
+/* cumulative distribution of the popularity ranks */
+double *zipf_cdf = NULL;
+
+
+static void ALRMhandler (int sig)
+{
+    keep_on_going = 0;
+}
+
+static void display_help(char *exec)
+{
+    printf("Usage: %s -m hostname -p port_number -n nb_clients -t nb_workers -d duration -z zipf_exponent -f mean_follows -w mix -S [display_server_stats]\n", exec);
+    printf("\t hostname can be an ip address\n" );
+    printf("\t mix is publish,timeline,follow,follow_count in %% (default %d,%d,%d,%d)\n",
+           mix[OP_PUBLISH], mix[OP_TIMELINE], mix[OP_FOLLOW], mix[OP_FOLLOW_COUNT]);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return (uint64_t)tt.tv_sec * 1000000000ULL + tt.tv_nsec;
+}
+
+/* uniform in [0,1) */
+static double uniform(void)
+{
+    return fastRandom32() / 4294967296.0;
+}
+
+static void zipf_init(void)
+{
+    double sum = 0;
+    int i = 0;
+
+    zipf_cdf = malloc(nb_clients * sizeof(double));
+    for(i = 0; i < nb_clients; i++){
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for(i = 0; i < nb_clients; i++){
+        zipf_cdf[i] /= sum;
+    }
+}
+
+/* rank whose interval of the cumulative distribution holds u */
+static int zipf_rank(double u)
+{
+    int lo = 0, hi = nb_clients - 1, mid = 0;
+
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] > u){
+            hi = mid;
+        }else{
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* rank drawn with the popularity law */
+static int zipf_draw(void)
+{
+    return zipf_rank(uniform());
+}
+
+/* rank drawn with the popularity law, among the ranks but excluded:
+ * u is drawn out of the interval of excluded, so that a popular
+ * client never has to be drawn again */
+static int zipf_draw_except(int excluded)
+{
+    double start = (excluded == 0)? 0 : zipf_cdf[excluded - 1];
+    double u = uniform() * (1.0 - (zipf_cdf[excluded] - start));
+    int rank = 0;
+
+    if(u >= start){
+        u += zipf_cdf[excluded] - start;
+    }
+
+    /* rounding may still land on excluded */
+    rank = zipf_rank(u);
+    return (rank == excluded)? (excluded + 1) % nb_clients : rank;
+}
+
+/* nb of clients followed, from a Pareto law of exponent 2 (whose mean
+ * is twice its minimum) */
+static int follows_draw(void)
+{
+    double d = (mean_follows / 2.0) / sqrt(1.0 - uniform());
+
+    if(d < 1){
+        return 1;
+    }
+    return (d > nb_clients - 1)? nb_clients - 1 : (int)d;
+}
+
+/* the requests of the client library are sent in two writes, the
+ * second one delayed by Nagle's algorithm until the first one is
+ * acknowledged */
+static void set_nodelay(int sockfd)
+{
+    int one = 1;
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void fail(client_t *c, const char *what)
+{
+    fprintf(stderr,"*** Test Failed ***\n");
+    fprintf(stderr,"%s failed to %s\n", c->name, what);
+    exit(-1);
+}
+
+/* makes client c follow the clients of its draw; returns the nb of
+ * edges */
+static unsigned long build_follows(int c, unsigned int *in_degrees)
+{
+    int nb = follows_draw(), i = 0, attempts = 0, target = 0;
+    char *followed = calloc(nb_clients, 1);
+    unsigned long nb_edges = 0;
+
+    followed[c] = 1;
+    for(i = 0, attempts = 0; i < nb && attempts < 10 * nb; attempts++){
+        if(followed[target = zipf_draw()]){
+            continue;
+        }
+        followed[target] = 1;
+        if(client_follow(clients[c].sockfd, clients[target].name, 0)){
+            fail(&clients[c], "follow");
+        }
+        __sync_fetch_and_add(&in_degrees[target], 1);
+        nb_edges++;
+        i++;
+    }
+
+    free(followed);
+    return nb_edges;
+}
+
+static op_t op_draw(void)
+{
+    int r = fastRandom32() % 100, op = 0;
+
+    for(op = 0; op < NB_OPS - 1 && r >= mix[op]; op++){
+        r -= mix[op];
+    }
+    return op;
+}
+
+/* locks a client drawn by draw(), redrawing it if it is busy */
+static client_t *client_acquire(int (*draw)(void))
+{
+    client_t *c = NULL;
+    int i = 0;
+
+    for(i = 0; i < WORKLOAD_REDRAWS; i++){
+        c = &clients[draw()];
+        if(pthread_mutex_trylock(&c->lock) == 0){
+            return c;
+        }
+    }
+    pthread_mutex_lock(&c->lock);
+    return c;
+}
+
+static int uniform_draw(void)
+{
+    return fastRandom32() % nb_clients;
+}
+
+static void run_op(worker_data_t *data, op_t op, char *msg)
+{
+    client_t *c = client_acquire((op == OP_PUBLISH)? zipf_draw : uniform_draw);
+    client_t *target = NULL;
+    uint64_t t0 = now_ns();
+
+    switch(op){
+    case OP_PUBLISH:
+        if(client_publish(c->sockfd, msg, 0)){
+            fail(c, "publish");
+        }
+        break;
+    case OP_TIMELINE:
+        if(client_timeline(c->sockfd, 1) < 0){
+            fail(c, "get its timeline");
+        }
+        break;
+    case OP_FOLLOW:
+        /* the new edges go to the popular clients */
+        target = &clients[zipf_draw_except(c - clients)];
+        if(client_follow(c->sockfd, target->name, 0)){
+            fail(c, "follow");
+        }
+        break;
+    default:
+        if(client_follow_count(c->sockfd) < 0){
+            fail(c, "count its followers");
+        }
+        break;
+    }
+
+    histogram_record(&data->latencies[op], now_ns() - t0);
+    data->nb_ops[op]++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void *worker_thread(void *arg)
+{
+    worker_data_t *data= (worker_data_t*) arg;
+    char msg[BABBLE_PUBLICATION_SIZE];
+    unsigned long seq = 0;
+
+    fastRandomSetSeed(data->worker_id * 7919 + 17);
+
+    for(seq = 0; keep_on_going; seq++){
+        snprintf(msg, BABBLE_PUBLICATION_SIZE, "wl_%d_%lu", data->worker_id, seq);
+        run_op(data, op_draw(), msg);
+    }
+    return NULL;
+}
+
+/* builds the graph of the clients given, in parallel */
+typedef struct setup_data{
+    int first, last;
+    unsigned int *in_degrees;
+    unsigned long nb_edges;
+} setup_data_t;
+
+static void *setup_thread(void *arg)
+{
+    setup_data_t *data= (setup_data_t*) arg;
+    int c = 0;
+
+    fastRandomSetSeed(data->first * 104729 + 3);
+    for(c = data->first; c < data->last; c++){
+        data->nb_edges += build_follows(c, data->in_degrees);
+    }
+    return NULL;
+}
+
+static int parse_mix(char *arg)
+{
+    char *saveptr = NULL, *ratio = NULL;
+    int op = 0, total = 0;
+
+    for(ratio = strtok_r(arg, ",", &saveptr); ratio != NULL && op < NB_OPS; ratio = strtok_r(NULL, ",", &saveptr), op++){
+        if((mix[op] = atoi(ratio)) < 0){
+            return -1;
+        }
+        total += mix[op];
+    }
+    return (op == NB_OPS && ratio == NULL && total == 100)? 0 : -1;
+}
+
+/* sends STATS with section, and displays the report */
+static void stats_display(int sockfd, const char *section)
+{
+    char *report = client_stats(sockfd, section);
+
+    if(report != NULL){
+        printf("%s", report);
+        free(report);
+    }
+}
+
+static void setup_graph(void)
+{
+    unsigned int *in_degrees = calloc(nb_clients, sizeof(unsigned int));
+    setup_data_t *setup = calloc(nb_workers, sizeof(setup_data_t));
+    pthread_t *tids = malloc(nb_workers * sizeof(pthread_t));
+    unsigned long nb_edges = 0;
+    unsigned int max_in = 0, nb_without = 0;
+    uint64_t t0 = now_ns();
+    int i = 0;
+
+    for(i = 0; i < nb_workers; i++){
+        setup[i].first = (long)nb_clients * i / nb_workers;
+        setup[i].last = (long)nb_clients * (i + 1) / nb_workers;
+        setup[i].in_degrees = in_degrees;
+        pthread_create(&tids[i], NULL, setup_thread, &setup[i]);
+    }
+    for(i = 0; i < nb_workers; i++){
+        pthread_join(tids[i], NULL);
+        nb_edges += setup[i].nb_edges;
+    }
+
+    for(i = 0; i < nb_clients; i++){
+        max_in = (in_degrees[i] > max_in)? in_degrees[i] : max_in;
+        nb_without += (in_degrees[i] == 0);
+    }
+
+    printf("follow graph: %lu edges in %.2lf s, followers: %s has %u, max %u, %u clients without\n",
+           nb_edges, (now_ns() - t0) / 1e9, clients[0].name, in_degrees[0], max_in, nb_without);
+
+    free(tids);
+    free(setup);
+    free(in_degrees);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int nb_args=1;
+    pthread_t *tids = NULL;
+    worker_data_t *workers = NULL;
+    histogram_t h;
+    unsigned long nb = 0, total = 0;
+    int stats_sock = -1;
+    int i = 0, op = 0;
+
+    signal (SIGALRM, ALRMhandler);
+
+    /* parsing command options */
+    while ((opt = getopt (argc, argv, "+hm:p:n:t:d:z:f:w:S")) != -1){
+        switch (opt){
+        case 'm':
+            strncpy(hostname,optarg,BABBLE_BUFFER_SIZE);
+            nb_args+=2;
+            break;
+        case 'p':
+            portno = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'n':
+            nb_clients = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 't':
+            nb_workers = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            nb_args+=2;
+            break;
+        case 'f':
+            mean_follows = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'w':
+            if(parse_mix(optarg)){
+                fprintf(stderr,"the ratios of the mix must add up to 100\n");
+                return -1;
+            }
+            nb_args+=2;
+            break;
+        case 'S':
+            with_stats=1;
+            nb_args+=1;
+            break;
+        case 'h':
+        case '?':
+        default:
+            display_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(nb_args != argc || nb_clients < 2 || nb_workers <= 0 || duration <= 0
+       || zipf_s < 0 || mean_follows <= 0){
+        display_help(argv[0]);
+        return -1;
+    }
+
+    printf("workload test with %d clients, %d workers, zipf exponent %.2lf, %d follows per client on average\n",
+           nb_clients, nb_workers, zipf_s, mean_follows);
+    printf("mix: publish %d%%, timeline %d%%, follow %d%%, follow_count %d%%\n",
+           mix[OP_PUBLISH], mix[OP_TIMELINE], mix[OP_FOLLOW], mix[OP_FOLLOW_COUNT]);
+
+    zipf_init();
+
+    clients = calloc(nb_clients, sizeof(client_t));
+    for(i = 0; i < nb_clients; i++){
+        snprintf(clients[i].name, BABBLE_ID_SIZE, "wl_%d", i);
+        pthread_mutex_init(&clients[i].lock, NULL);
+
+        if((clients[i].sockfd = connect_to_server(hostname, portno)) == -1
+           || client_login(clients[i].sockfd, clients[i].name) == 0){
+            fail(&clients[i], "login");
+        }
+        set_nodelay(clients[i].sockfd);
+    }
+
+    setup_graph();
+
+    /* only the requests of the test are reported */
+    if(with_stats){
+        if((stats_sock = connect_to_server(hostname, portno)) == -1
+           || client_login(stats_sock, "wl_stats") == 0){
+            fprintf(stderr,"failed to connect the stats client\n");
+            stats_sock = -1;
+        }else{
+            stats_display(stats_sock, "RESET");
+        }
+    }
+
+    tids = malloc(nb_workers * sizeof(pthread_t));
+    workers = calloc(nb_workers, sizeof(worker_data_t));
+
+    alarm(duration);
+    for(i = 0; i < nb_workers; i++){
+        workers[i].worker_id = i;
+        for(op = 0; op < NB_OPS; op++){
+            histogram_init(&workers[i].latencies[op]);
+        }
+        pthread_create(&tids[i], NULL, worker_thread, &workers[i]);
+    }
+    for(i = 0; i < nb_workers; i++){
+        pthread_join(tids[i], NULL);
+    }
+
+    printf("latencies in us\n");
+    printf("%12s %10s %10s %10s %10s %10s %10s %10s\n",
+           "op", "count", "ops/s", "mean", "p50", "p99", "p99.9", "max");
+
+    for(op = 0; op < NB_OPS; op++){
+        histogram_init(&h);
+        for(i = 0, nb = 0; i < nb_workers; i++){
+            histogram_add(&h, &workers[i].latencies[op]);
+            nb += workers[i].nb_ops[op];
+        }
+        total += nb;
+
+        printf("%12s %10lu %10.0lf %10.1lf %10.1lf %10.1lf %10.1lf %10.1lf\n",
+               op_names[op], nb, (double)nb / duration,
+               histogram_mean(&h) / 1000.0,
+               histogram_percentile(&h, 50.0) / 1000.0,
+               histogram_percentile(&h, 99.0) / 1000.0,
+               histogram_percentile(&h, 99.9) / 1000.0,
+               histogram_max(&h) / 1000.0);
+    }
+    printf("%12s %10lu %10.0lf\n", "all", total, (double)total / duration);
+
+    if(stats_sock != -1){
+        printf("\n server ");
+        stats_display(stats_sock, "TOP");
+        close(stats_sock);
+    }
+
+    for(i = 0; i < nb_clients; i++){
+        close(clients[i].sockfd);
+    }
+    return 0;
+}